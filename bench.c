@@ -0,0 +1,479 @@
+/**
+ * @file bench.c
+ *
+ * @brief Microbenchmarks for the server's building blocks, without a network.
+ *
+ * With -s it times the statistics module: each thread bumps a counter and
+ * records a histogram sample in a loop, once with stat_add() and
+ * stat_record() on its own stats block, once with an atomic add to a
+ * counter and a histogram bucket shared by all threads, and once doing
+ * nothing, for the cost of the loop itself. Both variants do the same work,
+ * so they differ only in sharing. The run is repeated with 1, 2, 4 and so on
+ * up to -t threads, so the figures show what counting costs and whether it
+ * scales.
+ *
+ * With -q it times the queues in queue.h: 1, 2, 4 and so on up to -t
+ * producers push numbered items while one consumer pops them, as reactors
+ * and pool workers do with a mailbox. The MPSC queue runs against a list
+ * behind a mutex; the MPSC queue with a doorbell runs as a mailbox does,
+ * the consumer sleeping in poll() until it is rung, and reports how many
+ * eventfd writes each item cost; the SPSC ring of the reactor channels runs
+ * with one producer only. The consumer checks that each producer's items
+ * come out in the order they went in.
+ *
+ * With -c it times a coroutine switch: one coro_resume() into a handler
+ * that counts and yields straight back, against a call through a function
+ * pointer doing the same count, as on_conn_event() calls the protocol. The
+ * difference is what writing a handler with coroutines costs per event.
+ *
+ * Build: cc -O2 -pthread -o bench bench.c stats.c coro.c
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "stats.h"
+
+#define DEFAULT_STATS_OPS 100000000ULL
+#define DEFAULT_QUEUE_OPS 1000000ULL
+#define DEFAULT_CORO_OPS 10000000ULL
+#define SPINS_BEFORE_YIELD 64
+#define QUEUE_RING_SIZE 256
+#define DEFAULT_THREADS 8
+
+enum stats_variant {
+    VARIANT_NONE,           /* the bare loop */
+    VARIANT_SHARDED,        /* stat_add() and stat_record() on the thread's own block */
+    VARIANT_SHARED,         /* the same through one atomic counter and histogram for every thread */
+    VARIANTS
+};
+
+static const char *const variant_names[VARIANTS] = { "empty loop", "sharded", "shared atomic" };
+
+struct stats_run {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    struct stats_block *block;
+    enum stats_variant variant;
+    uint64_t ops;
+};
+
+static alignas(CACHE_LINE) atomic_uint_fast64_t shared_counter;
+static alignas(CACHE_LINE) atomic_uint_fast64_t shared_buckets[STAT_BUCKETS];
+
+enum queue_variant {
+    QUEUE_MPSC,             /* mpsc_push() and mpsc_pop() */
+    QUEUE_MUTEX,            /* a singly linked list behind one mutex */
+    QUEUE_DOORBELL,         /* mpsc_push() and doorbell_ring(), the consumer asleep in poll() */
+    QUEUE_SPSC,             /* spsc_push() and spsc_pop(), one producer only */
+    QUEUE_VARIANTS
+};
+
+static const char *const queue_names[QUEUE_VARIANTS] = { "mpsc", "mutex list", "mpsc+doorbell", "spsc" };
+
+struct queue_item {
+    struct mpsc_node node;
+    struct queue_item *next;        /* the mutex list */
+    unsigned producer;
+    uint64_t seq;
+};
+
+struct queue_bench {
+    struct mpsc_queue mpsc;
+    struct spsc_ring spsc;
+    struct doorbell bell;
+    alignas(CACHE_LINE) pthread_mutex_t lock;
+    struct queue_item *head;
+    struct queue_item **tail;
+    pthread_barrier_t start;
+    enum queue_variant variant;
+    uint64_t ops;
+};
+
+struct switch_count {
+    uint64_t ops;
+    uint64_t seen;
+};
+
+struct queue_producer {
+    pthread_t thread;
+    struct queue_bench *bench;
+    struct queue_item *items;
+    uint64_t rings;                 /* eventfd writes */
+    unsigned index;
+};
+
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+/* stat_record() on the shared histogram: the same bucket, with a locked add. */
+void shared_record(const uint64_t value) {
+    const unsigned bucket = value ? 64 - (unsigned) __builtin_clzll(value) : 0;
+    atomic_fetch_add_explicit(&shared_buckets[bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1], 1,
+                              memory_order_relaxed);
+}
+
+
+void *stats_thread(void *arg) {
+    struct stats_run *run = arg;
+
+    thread_stats = run->block;
+    pthread_barrier_wait(run->start);
+    for (uint64_t i = 0; i < run->ops; ++i) {
+        switch (run->variant) {
+            case VARIANT_SHARDED:
+                stat_add(STAT_BYTES_IN, 1);
+                stat_record(i & 0xffff);
+                break;
+            case VARIANT_SHARED:
+                atomic_fetch_add_explicit(&shared_counter, 1, memory_order_relaxed);
+                shared_record(i & 0xffff);
+                break;
+            default:
+                /* Keeps the compiler from deleting the loop. */
+                __asm__ volatile("" ::: "memory");
+        }
+    }
+    return NULL;
+}
+
+
+/* Returns the wall time for `threads` threads doing `ops` operations each. */
+double stats_round(const unsigned threads, const enum stats_variant variant, const uint64_t ops,
+                   struct stats_block *blocks) {
+    struct stats_run *runs = calloc(threads, sizeof(*runs));
+    pthread_barrier_t start;
+
+    if (runs == NULL) {
+        perror("calloc");
+        exit(2);
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (unsigned i = 0; i < threads; ++i) {
+        runs[i] = (struct stats_run) { .start = &start, .block = &blocks[i], .variant = variant, .ops = ops };
+        if (pthread_create(&runs[i].thread, NULL, stats_thread, &runs[i])) {
+            perror("pthread_create");
+            exit(3);
+        }
+    }
+    pthread_barrier_wait(&start);
+    const double began = now_seconds();
+    for (unsigned i = 0; i < threads; ++i) pthread_join(runs[i].thread, NULL);
+    const double elapsed = now_seconds() - began;
+    pthread_barrier_destroy(&start);
+    free(runs);
+    return elapsed;
+}
+
+
+void bench_stats(const unsigned max_threads, const uint64_t ops) {
+    struct stats_block *blocks = stats_alloc(max_threads, false);
+    struct stats_total total;
+
+    if (blocks == NULL) {
+        perror("stats_alloc");
+        exit(2);
+    }
+    fprintf(stderr, "[*] %ld CPUs online, %llu operations per thread.\n", sysconf(_SC_NPROCESSORS_ONLN),
+            (unsigned long long) ops);
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        for (unsigned variant = 0; variant < VARIANTS; ++variant) {
+            const double elapsed = stats_round(threads, variant, ops, blocks);
+            fprintf(stderr, "[*] %3u threads, %-13s: %6.2f ns per operation and thread, %8.1f Mops/s in all\n",
+                    threads, variant_names[variant], elapsed * 1e9 / (double) ops,
+                    (double) (ops * threads) / elapsed / 1e6);
+        }
+    }
+
+    /* The sums must be exact, or a thread's store was lost. */
+    stats_sum(blocks, max_threads, &total);
+    uint64_t expected = 0;
+    uint64_t shared_samples = 0;
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) expected += ops * threads;
+    for (unsigned i = 0; i < STAT_BUCKETS; ++i) shared_samples += atomic_load(&shared_buckets[i]);
+    if (total.counters[STAT_BYTES_IN] != expected || atomic_load(&shared_counter) != expected
+        || shared_samples != expected) {
+        fprintf(stderr, "[!] Counted %llu sharded, %llu shared, %llu shared samples, expected %llu.\n",
+                (unsigned long long) total.counters[STAT_BYTES_IN], (unsigned long long) atomic_load(&shared_counter),
+                (unsigned long long) shared_samples, (unsigned long long) expected);
+        exit(9);
+    }
+    stats_free(blocks, max_threads);
+}
+
+
+void *queue_producer(void *arg) {
+    struct queue_producer *producer = arg;
+    struct queue_bench *bench = producer->bench;
+
+    pthread_barrier_wait(&bench->start);
+    for (uint64_t i = 0; i < bench->ops; ++i) {
+        struct queue_item *item = &producer->items[i];
+        item->producer = producer->index;
+        item->seq = i;
+        switch (bench->variant) {
+            case QUEUE_MPSC:
+                mpsc_push(&bench->mpsc, &item->node);
+                continue;
+            case QUEUE_DOORBELL:
+                mpsc_push(&bench->mpsc, &item->node);
+                producer->rings += doorbell_ring(&bench->bell);
+                continue;
+            case QUEUE_SPSC:
+                while (!spsc_push(&bench->spsc, item)) sched_yield();
+                continue;
+            default:
+                break;
+        }
+        item->next = NULL;
+        pthread_mutex_lock(&bench->lock);
+        *bench->tail = item;
+        bench->tail = &item->next;
+        pthread_mutex_unlock(&bench->lock);
+    }
+    return NULL;
+}
+
+
+struct queue_item *queue_pop(struct queue_bench *bench) {
+    if (bench->variant == QUEUE_SPSC) return spsc_pop(&bench->spsc);
+    if (bench->variant != QUEUE_MUTEX) {
+        struct mpsc_node *node = mpsc_pop(&bench->mpsc);
+        return node ? container_of(node, struct queue_item, node) : NULL;
+    }
+    pthread_mutex_lock(&bench->lock);
+    struct queue_item *item = bench->head;
+    if (item) {
+        bench->head = item->next;
+        if (bench->head == NULL) bench->tail = &bench->head;
+    }
+    pthread_mutex_unlock(&bench->lock);
+    return item;
+}
+
+
+/* Sleeps until the doorbell rings, then re-arms it for the drain that follows. */
+void queue_wait(struct queue_bench *bench) {
+    struct pollfd pfd = { .fd = bench->bell.event_fd, .events = POLLIN };
+
+    while (poll(&pfd, 1, -1) == -1) {
+        perror("poll");
+        exit(4);
+    }
+    doorbell_clear(&bench->bell);
+}
+
+
+/* Runs `producers` producers against the calling thread as the consumer.
+ * Returns the wall time until the consumer has every item, and the eventfd
+ * writes in *rings.
+ */
+double queue_round(const unsigned producers, const enum queue_variant variant, const uint64_t ops,
+                   uint64_t *rings) {
+    struct queue_bench *bench = aligned_alloc(CACHE_LINE, sizeof(*bench));
+    struct queue_producer *threads = calloc(producers, sizeof(*threads));
+    uint64_t *expected = calloc(producers, sizeof(*expected));
+
+    if (bench == NULL || threads == NULL || expected == NULL) {
+        perror("calloc");
+        exit(2);
+    }
+    mpsc_init(&bench->mpsc);
+    if (spsc_init(&bench->spsc, QUEUE_RING_SIZE) == -1 || doorbell_init(&bench->bell) == -1) {
+        perror("queue_round");
+        exit(2);
+    }
+    pthread_mutex_init(&bench->lock, NULL);
+    bench->head = NULL;
+    bench->tail = &bench->head;
+    bench->variant = variant;
+    bench->ops = ops;
+    pthread_barrier_init(&bench->start, NULL, producers + 1);
+    for (unsigned i = 0; i < producers; ++i) {
+        threads[i] = (struct queue_producer) { .bench = bench, .index = i };
+        threads[i].items = malloc(ops * sizeof(struct queue_item));
+        if (threads[i].items == NULL) {
+            perror("malloc");
+            exit(2);
+        }
+        if (pthread_create(&threads[i].thread, NULL, queue_producer, &threads[i])) {
+            perror("pthread_create");
+            exit(3);
+        }
+    }
+
+    pthread_barrier_wait(&bench->start);
+    const double began = now_seconds();
+    unsigned spins = 0;
+    for (uint64_t received = 0; received < ops * producers;) {
+        struct queue_item *item = queue_pop(bench);
+        if (item == NULL) {
+            if (variant == QUEUE_DOORBELL) queue_wait(bench);
+            /* With fewer CPUs than threads the producers need this one. */
+            else if (++spins % SPINS_BEFORE_YIELD == 0) sched_yield();
+            continue;
+        }
+        if (item->seq != expected[item->producer]++) {
+            fprintf(stderr, "[!] Producer %u: item %llu came out of order.\n", item->producer,
+                    (unsigned long long) item->seq);
+            exit(9);
+        }
+        received++;
+    }
+    const double elapsed = now_seconds() - began;
+
+    *rings = 0;
+    for (unsigned i = 0; i < producers; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        *rings += threads[i].rings;
+        free(threads[i].items);
+    }
+    pthread_barrier_destroy(&bench->start);
+    close(bench->bell.event_fd);
+    spsc_free(&bench->spsc);
+    pthread_mutex_destroy(&bench->lock);
+    free(expected);
+    free(threads);
+    free(bench);
+    return elapsed;
+}
+
+
+void bench_queue(const unsigned max_producers, const uint64_t ops) {
+    fprintf(stderr, "[*] %ld CPUs online, %llu items per producer.\n", sysconf(_SC_NPROCESSORS_ONLN),
+            (unsigned long long) ops);
+    for (unsigned producers = 1; producers <= max_producers; producers *= 2) {
+        for (unsigned variant = 0; variant < QUEUE_VARIANTS; ++variant) {
+            uint64_t rings;
+            if (variant == QUEUE_SPSC && producers > 1) continue;
+            const double elapsed = queue_round(producers, variant, ops, &rings);
+            fprintf(stderr, "[*] %3u producers, %-13s: %6.2f ns per item, %8.1f Mitems/s", producers,
+                    queue_names[variant], elapsed * 1e9 / (double) (ops * producers),
+                    (double) (ops * producers) / elapsed / 1e6);
+            if (variant == QUEUE_DOORBELL) {
+                fprintf(stderr, ", %llu eventfd writes, %.4f per item", (unsigned long long) rings,
+                        (double) rings / (double) (ops * producers));
+            }
+            fputc('\n', stderr);
+        }
+    }
+}
+
+
+/* The handler of the callback path. */
+void count_call(struct switch_count *count) {
+    count->seen++;
+}
+
+/* Volatile so the call stays an indirect call, as through struct protocol. */
+static void (*volatile callback)(struct switch_count *) = count_call;
+
+
+/* The handler of the coroutine path: one count per resume. */
+void count_resume(struct coro *co, void *arg) {
+    struct switch_count *count = arg;
+
+    while (true) {
+        count->seen++;
+        if (count->seen == count->ops) return;
+        coro_yield(co);
+    }
+}
+
+
+void bench_coro(const uint64_t ops) {
+    struct switch_count calls = { .ops = ops };
+    struct switch_count resumes = { .ops = ops };
+
+    fprintf(stderr, "[*] %llu events on one thread.\n", (unsigned long long) ops);
+
+    double began = now_seconds();
+    for (uint64_t i = 0; i < ops; ++i) callback(&calls);
+    const double called = now_seconds() - began;
+
+    struct coro *co = coro_create(count_resume, &resumes);
+    if (co == NULL) {
+        perror("coro_create");
+        exit(2);
+    }
+    began = now_seconds();
+    for (uint64_t i = 0; i < ops; ++i) coro_resume(co);
+    const double resumed = now_seconds() - began;
+    if (!coro_done(co) || calls.seen != ops || resumes.seen != ops) {
+        fprintf(stderr, "[!] Counted %llu calls and %llu resumes, expected %llu.\n",
+                (unsigned long long) calls.seen, (unsigned long long) resumes.seen, (unsigned long long) ops);
+        exit(9);
+    }
+    coro_destroy(co);
+
+    fprintf(stderr, "[*] callback       : %6.2f ns per event\n", called * 1e9 / (double) ops);
+    fprintf(stderr, "[*] resume + yield : %6.2f ns per event\n", resumed * 1e9 / (double) ops);
+}
+
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -s | -q | -c [-t threads] [-n operations]\n"
+                    "  -s  statistics: sharded counters against one shared atomic, 1 to -t threads\n"
+                    "  -q  queues: 1 to -t producers into one MPSC queue, with and without a doorbell,\n"
+                    "      against a mutex list, and one producer into an SPSC ring\n"
+                    "  -c  coroutines: resume and yield against a call through a function pointer\n", name);
+    exit(1);
+}
+
+
+int main(const int argc, char *argv[]) {
+    unsigned max_threads = DEFAULT_THREADS;
+    uint64_t ops = 0;
+    bool stats = false;
+    bool queue = false;
+    bool coro = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sqct:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                stats = true;
+                break;
+            case 'q':
+                queue = true;
+                break;
+            case 'c':
+                coro = true;
+                break;
+            case 't':
+                max_threads = (unsigned) atoi(optarg);
+                break;
+            case 'n':
+                ops = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (stats + queue + coro != 1 || max_threads == 0) usage(argv[0]);
+
+    if (stats) bench_stats(max_threads, ops ? ops : DEFAULT_STATS_OPS);
+    else if (queue) bench_queue(max_threads, ops ? ops : DEFAULT_QUEUE_OPS);
+    else bench_coro(ops ? ops : DEFAULT_CORO_OPS);
+    return 0;
+}
@@ -0,0 +1,437 @@
+/**
+ * @file cache.c
+ *
+ * @brief One shard of the memcached-style cache: a hash table over slab memory.
+ *
+ * The table is open addressing over groups of 16 slots. Each slot has a one
+ * byte tag, seven bits of the key's hash, so one SSE2 compare finds the
+ * candidates of a whole group and the keys themselves are only read for
+ * slots whose tag matched. A group with an empty slot ends the probe.
+ *
+ * Items live in slab chunks. Size classes grow by 1.25x, and each class
+ * carves 1 MiB pages into equal chunks, so memory never fragments and an
+ * allocation is a free-list pop. Once the shard holds its limit in pages, a
+ * class that runs out of chunks evicts one of its own items with CLOCK: the
+ * hand skips and clears items read since it last passed and takes the first
+ * one that was not. A class left without any page takes one from the class
+ * that has the most.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cache.h"
+
+#define SLAB_PAGE (1024 * 1024)
+#define SLAB_MIN_CHUNK 64
+#define SLAB_CLASSES 64
+#define GROUP_SIZE 16
+#define TABLE_INITIAL_GROUPS 64
+#define TAG_EMPTY 0x80
+#define TAG_DELETED 0xfe
+
+
+struct slab_class {
+    size_t size;                /* chunk size */
+    size_t per_page;
+    char **pages;
+    size_t page_count;
+    struct item *free;
+    size_t hand;                /* CLOCK position, a chunk index over all pages */
+};
+
+struct cache {
+    uint8_t *tags;              /* TAG_EMPTY, TAG_DELETED or the low 7 hash bits */
+    struct item **items;
+    size_t group_mask;
+    size_t used;                /* slots holding an item */
+    size_t deleted;             /* slots holding a tombstone */
+    size_t pages;
+    size_t page_limit;
+    unsigned class_count;
+    struct slab_class classes[SLAB_CLASSES];
+};
+
+
+/* FNV-1a, finished with a 64-bit mix so the tag and group bits are both good. */
+uint64_t cache_hash(const char *key, const size_t key_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key_len; ++i) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+/* Bit i set: tag i of the group equals `tag`. */
+static inline unsigned group_match(const uint8_t *tags, const uint8_t tag) {
+#ifdef __SSE2__
+    const __m128i group = _mm_load_si128((const __m128i *) tags);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag)));
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < GROUP_SIZE; ++i) mask |= (unsigned) (tags[i] == tag) << i;
+    return mask;
+#endif
+}
+
+
+/* Empty and deleted tags are the ones with the top bit set. */
+static inline unsigned group_free(const uint8_t *tags) {
+#ifdef __SSE2__
+    return (unsigned) _mm_movemask_epi8(_mm_load_si128((const __m128i *) tags));
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < GROUP_SIZE; ++i) mask |= (unsigned) (tags[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+
+static inline uint8_t hash_tag(const uint64_t hash) {
+    return (uint8_t) (hash & 0x7f);
+}
+
+
+static inline size_t hash_group(const struct cache *cache, const uint64_t hash) {
+    return (size_t) (hash >> 7) & cache->group_mask;
+}
+
+
+/* Triangular steps visit every group of a power-of-two table. */
+static inline size_t next_group(const struct cache *cache, const size_t group, const size_t step) {
+    return (group + step) & cache->group_mask;
+}
+
+
+static int table_alloc(struct cache *cache, const size_t groups) {
+    uint8_t *tags = aligned_alloc(GROUP_SIZE, groups * GROUP_SIZE);
+    struct item **items = malloc(groups * GROUP_SIZE * sizeof(*items));
+    if (tags == NULL || items == NULL) {
+        free(tags);
+        free(items);
+        return -1;
+    }
+    memset(tags, TAG_EMPTY, groups * GROUP_SIZE);
+    cache->tags = tags;
+    cache->items = items;
+    cache->group_mask = groups - 1;
+    cache->used = 0;
+    cache->deleted = 0;
+    return 0;
+}
+
+
+/* Slot of the key, or -1. */
+static ssize_t table_find(const struct cache *cache, const char *key, const size_t key_len, const uint64_t hash) {
+    const uint8_t tag = hash_tag(hash);
+    size_t group = hash_group(cache, hash);
+
+    for (size_t step = 1;; ++step) {
+        const uint8_t *tags = &cache->tags[group * GROUP_SIZE];
+        for (unsigned match = group_match(tags, tag); match; match &= match - 1) {
+            const size_t slot = group * GROUP_SIZE + (size_t) __builtin_ctz(match);
+            const struct item *item = cache->items[slot];
+            if (item->hash == hash && item->key_len == key_len && memcmp(item->data, key, key_len) == 0) {
+                return (ssize_t) slot;
+            }
+        }
+        if (group_match(tags, TAG_EMPTY)) return -1;
+        group = next_group(cache, group, step);
+    }
+}
+
+
+/* Slot holding exactly this item; it must be in the table. */
+static size_t table_slot_of(const struct cache *cache, const struct item *item) {
+    const uint8_t tag = hash_tag(item->hash);
+    size_t group = hash_group(cache, item->hash);
+
+    for (size_t step = 1;; ++step) {
+        const uint8_t *tags = &cache->tags[group * GROUP_SIZE];
+        for (unsigned match = group_match(tags, tag); match; match &= match - 1) {
+            const size_t slot = group * GROUP_SIZE + (size_t) __builtin_ctz(match);
+            if (cache->items[slot] == item) return slot;
+        }
+        group = next_group(cache, group, step);
+    }
+}
+
+
+/* Places an item known not to be in the table. */
+static void table_place(struct cache *cache, struct item *item) {
+    size_t group = hash_group(cache, item->hash);
+
+    for (size_t step = 1;; ++step) {
+        const unsigned free_slots = group_free(&cache->tags[group * GROUP_SIZE]);
+        if (free_slots) {
+            const size_t slot = group * GROUP_SIZE + (size_t) __builtin_ctz(free_slots);
+            if (cache->tags[slot] == TAG_DELETED) cache->deleted--;
+            cache->tags[slot] = hash_tag(item->hash);
+            cache->items[slot] = item;
+            cache->used++;
+            return;
+        }
+        group = next_group(cache, group, step);
+    }
+}
+
+
+/* A probe never runs past a group that still has an empty slot, so such a
+ * group can take an empty tag back; any other needs a tombstone.
+ */
+static void table_remove(struct cache *cache, const size_t slot) {
+    const uint8_t *tags = &cache->tags[slot & ~(size_t) (GROUP_SIZE - 1)];
+    if (group_match(tags, TAG_EMPTY)) cache->tags[slot] = TAG_EMPTY;
+    else {
+        cache->tags[slot] = TAG_DELETED;
+        cache->deleted++;
+    }
+    cache->used--;
+}
+
+
+/* Keeps the table at most 7/8 full of items and tombstones. Mostly
+ * tombstones: rebuild at the same size; otherwise double.
+ */
+static int table_reserve(struct cache *cache) {
+    const size_t slots = (cache->group_mask + 1) * GROUP_SIZE;
+    if ((cache->used + cache->deleted + 1) * 8 <= slots * 7) return 0;
+
+    const size_t groups = cache->used * 2 < slots ? cache->group_mask + 1 : (cache->group_mask + 1) * 2;
+    uint8_t *old_tags = cache->tags;
+    struct item **old_items = cache->items;
+    if (table_alloc(cache, groups) == -1) return -1;
+    for (size_t slot = 0; slot < slots; ++slot) {
+        if (old_tags[slot] < TAG_EMPTY) table_place(cache, old_items[slot]);
+    }
+    free(old_tags);
+    free(old_items);
+    return 0;
+}
+
+
+static unsigned slab_class_for(const struct cache *cache, const size_t size) {
+    unsigned cls = 0;
+    while (cls < cache->class_count && cache->classes[cls].size < size) cls++;
+    return cls;
+}
+
+
+static inline struct item *slab_chunk(const struct slab_class *sc, const size_t index) {
+    return (struct item *) (sc->pages[index / sc->per_page] + (index % sc->per_page) * sc->size);
+}
+
+
+/* Carves a page into the class's chunks. */
+static int slab_add_page(struct cache *cache, struct slab_class *sc, char *page) {
+    char **pages = realloc(sc->pages, (sc->page_count + 1) * sizeof(*pages));
+    if (pages == NULL) {
+        free(page);
+        return -1;
+    }
+    sc->pages = pages;
+    sc->pages[sc->page_count++] = page;
+    cache->pages++;
+
+    for (size_t i = sc->per_page; i-- > 0;) {
+        struct item *chunk = (struct item *) (page + i * sc->size);
+        chunk->live = 0;
+        chunk->next_free = sc->free;
+        sc->free = chunk;
+    }
+    return 0;
+}
+
+
+static int slab_grow(struct cache *cache, struct slab_class *sc) {
+    char *page = aligned_alloc(64, SLAB_PAGE);
+    if (page == NULL) return -1;
+    return slab_add_page(cache, sc, page);
+}
+
+
+static void slab_release(struct cache *cache, struct item *item) {
+    struct slab_class *sc = &cache->classes[item->cls];
+    item->live = 0;
+    item->next_free = sc->free;
+    sc->free = item;
+}
+
+
+/* Takes the first item the hand finds unreferenced. Two full turns clear
+ * every bit, so this only fails for a class that has no live items.
+ */
+static struct item *clock_evict(struct cache *cache, struct slab_class *sc) {
+    const size_t chunks = sc->page_count * sc->per_page;
+
+    for (size_t n = 0; n < 2 * chunks; ++n) {
+        struct item *item = slab_chunk(sc, sc->hand);
+        sc->hand = (sc->hand + 1) % chunks;
+        if (!item->live) continue;
+        if (item->referenced) {
+            item->referenced = 0;
+            continue;
+        }
+        table_remove(cache, table_slot_of(cache, item));
+        item->live = 0;
+        return item;
+    }
+    return NULL;
+}
+
+
+/* A class that never got a page before the limit was reached would refuse
+ * every item of its size. It takes the page under the hand of the class with
+ * the most pages instead, evicting everything on it.
+ */
+static int slab_reassign(struct cache *cache, struct slab_class *sc) {
+    struct slab_class *donor = NULL;
+
+    for (unsigned cls = 0; cls < cache->class_count; ++cls) {
+        struct slab_class *candidate = &cache->classes[cls];
+        if (candidate != sc && candidate->page_count > (donor ? donor->page_count : 0)) donor = candidate;
+    }
+    if (donor == NULL) return -1;
+
+    const size_t index = donor->hand / donor->per_page;
+    char *page = donor->pages[index];
+    for (size_t i = 0; i < donor->per_page; ++i) {
+        const struct item *item = (const struct item *) (page + i * donor->size);
+        if (item->live) table_remove(cache, table_slot_of(cache, item));
+    }
+    for (struct item **link = &donor->free; *link;) {
+        if ((char *) *link >= page && (char *) *link < page + SLAB_PAGE) *link = (*link)->next_free;
+        else link = &(*link)->next_free;
+    }
+    donor->pages[index] = donor->pages[--donor->page_count];
+    donor->hand = 0;
+    cache->pages--;
+    return slab_add_page(cache, sc, page);
+}
+
+
+static struct item *slab_alloc(struct cache *cache, const unsigned cls) {
+    struct slab_class *sc = &cache->classes[cls];
+
+    if (sc->free == NULL && (cache->pages >= cache->page_limit || slab_grow(cache, sc) == -1)) {
+        if (sc->page_count) return clock_evict(cache, sc);
+        if (slab_reassign(cache, sc) == -1) return NULL;
+    }
+    struct item *item = sc->free;
+    sc->free = item->next_free;
+    return item;
+}
+
+
+struct cache *cache_create(const size_t limit) {
+    struct cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) return NULL;
+    if (table_alloc(cache, TABLE_INITIAL_GROUPS) == -1) {
+        free(cache);
+        return NULL;
+    }
+    cache->page_limit = limit / SLAB_PAGE ? limit / SLAB_PAGE : 1;
+
+    /* Chunks stay 8-byte aligned; the last class is a whole page. */
+    size_t size = SLAB_MIN_CHUNK;
+    while (cache->class_count < SLAB_CLASSES - 1 && size <= SLAB_PAGE / 2) {
+        cache->classes[cache->class_count].size = size;
+        cache->classes[cache->class_count].per_page = SLAB_PAGE / size;
+        cache->class_count++;
+        size = (size * 5 / 4 + 7) & ~(size_t) 7;
+    }
+    cache->classes[cache->class_count].size = SLAB_PAGE;
+    cache->classes[cache->class_count].per_page = 1;
+    cache->class_count++;
+    return cache;
+}
+
+
+void cache_destroy(struct cache *cache) {
+    if (cache == NULL) return;
+    for (unsigned cls = 0; cls < cache->class_count; ++cls) {
+        for (size_t i = 0; i < cache->classes[cls].page_count; ++i) free(cache->classes[cls].pages[i]);
+        free(cache->classes[cls].pages);
+    }
+    free(cache->tags);
+    free(cache->items);
+    free(cache);
+}
+
+
+const struct item *cache_get(struct cache *cache, const char *key, const size_t key_len, const uint64_t hash) {
+    const ssize_t slot = table_find(cache, key, key_len, hash);
+    if (slot < 0) return NULL;
+
+    struct item *item = cache->items[slot];
+    if (item->expires && item->expires <= (uint32_t) time(NULL)) {
+        table_remove(cache, (size_t) slot);
+        slab_release(cache, item);
+        return NULL;
+    }
+    /* Only write when the bit changes, so reading a hot item does not dirty its line. */
+    if (!item->referenced) item->referenced = 1;
+    return item;
+}
+
+
+int cache_set(struct cache *cache, const char *key, const size_t key_len, const uint64_t hash, const char *value,
+              const size_t value_len, const uint32_t flags, const uint32_t expires) {
+    const size_t size = sizeof(struct item) + key_len + value_len;
+    if (key_len > CACHE_MAX_KEY || size > SLAB_PAGE) return -1;
+
+    /* Allocate first: eviction may take the item this one replaces. */
+    const unsigned cls = slab_class_for(cache, size);
+    struct item *item = slab_alloc(cache, cls);
+    if (item == NULL) return -1;
+
+    item->hash = hash;
+    item->flags = flags;
+    item->expires = expires;
+    item->value_len = (uint32_t) value_len;
+    item->key_len = (uint8_t) key_len;
+    item->cls = (uint8_t) cls;
+    item->referenced = 1;
+    item->live = 1;
+    memcpy(item->data, key, key_len);
+    memcpy(item->data + key_len, value, value_len);
+
+    const ssize_t slot = table_find(cache, key, key_len, hash);
+    if (slot >= 0) {
+        slab_release(cache, cache->items[slot]);
+        cache->items[slot] = item;
+        return 0;
+    }
+    if (table_reserve(cache) == -1) {
+        slab_release(cache, item);
+        return -1;
+    }
+    table_place(cache, item);
+    return 0;
+}
+
+
+bool cache_delete(struct cache *cache, const char *key, const size_t key_len, const uint64_t hash) {
+    const ssize_t slot = table_find(cache, key, key_len, hash);
+    if (slot < 0) return false;
+    struct item *item = cache->items[slot];
+    table_remove(cache, (size_t) slot);
+    slab_release(cache, item);
+    return true;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file cache.h
+ *
+ * @brief One shard of the memcached-style cache: a hash table over slab memory.
+ *
+ * A shard is not thread-safe. Each reactor owns one and is the only thread
+ * that touches it; other reactors send it their keys instead.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_MAX_KEY 250
+
+/* An item lives in one slab chunk: header, key, value. */
+struct item {
+    union {
+        uint64_t hash;
+        struct item *next_free;     /* while the chunk is unused */
+    };
+    uint32_t flags;                 /* opaque to the cache, returned with the value */
+    uint32_t expires;               /* unix time, 0 = never */
+    uint32_t value_len;
+    uint8_t key_len;
+    uint8_t cls;                    /* slab class */
+    uint8_t referenced;             /* CLOCK bit: read since the hand last passed */
+    uint8_t live;
+    char data[];
+};
+
+struct cache;
+
+/* A shard allowed `limit` bytes of item memory. Returns NULL when out of memory. */
+struct cache *cache_create(size_t limit);
+
+void cache_destroy(struct cache *cache);
+
+uint64_t cache_hash(const char *key, size_t key_len);
+
+/* The item stays valid until the next call that changes the shard. */
+const struct item *cache_get(struct cache *cache, const char *key, size_t key_len, uint64_t hash);
+
+/* Returns -1 when the item cannot fit: larger than a slab page, or no memory
+ * for its size class even after eviction.
+ */
+int cache_set(struct cache *cache, const char *key, size_t key_len, uint64_t hash, const char *value,
+              size_t value_len, uint32_t flags, uint32_t expires);
+
+bool cache_delete(struct cache *cache, const char *key, size_t key_len, uint64_t hash);
+
+static inline const char *item_key(const struct item *item) {
+    return item->data;
+}
+
+static inline const char *item_value(const struct item *item) {
+    return item->data + item->key_len;
+}
+
+#endif /* CACHE_H */
@@ -3,6 +3,41 @@
  *
  * @brief A very simple TCP echo-client to connect to a server that is next door in the directory.
  *
+ * By default stdin is streamed to the server while the replies stream to
+ * stdout, both at once: one epoll loop moves whatever either side is ready
+ * for, so a large or pipelined input never waits for its echoes. Replies
+ * are written to stdout in whole lines, however the bytes were split on
+ * the way.
+ *
+ * With -n the client is a netcat: the input, stdin or the file given with
+ * -i, goes to the server and whatever comes back to stdout, byte for byte.
+ * Where the descriptors allow it nothing passes through user space: a file
+ * is sent with sendfile(), a pipe spliced into the socket, and the socket
+ * spliced into a stdout pipe, or through a pipe of its own into a stdout
+ * file.
+ *
+ * With -c the client measures connection churn instead: threads that
+ * connect, optionally exchange one line, and close, as fast as they can,
+ * for the server's accept and close paths. -L picks who ends up in
+ * TIME_WAIT.
+ *
+ * With -H the client opens and holds that many connections at once, for the
+ * server's memory and event loop at scale. Past the 28k or so ports one
+ * source address has towards one server, connections are spread over
+ * 127.0.0.1, 127.0.0.2 and so on: loopback answers on all of 127/8. Each
+ * socket binds its source with IP_BIND_ADDRESS_NO_PORT, so the port is
+ * picked at connect() time per destination rather than reserved by bind().
+ *
+ * With -V the client checks what an echo server sends back: each
+ * connection sends frames of varying size, each a header with a sequence
+ * number and the XXH64 of the payload, and every frame that comes back must
+ * be the next in sequence, of the right length, and hash to the same
+ * value. Payloads are slices of one random pool, sent with writev() and
+ * never copied, and XXH64 hashes at several GB/s, so the check keeps up
+ * with loopback.
+ *
+ * Build: cc -O2 -pthread -o client client.c
+ *
  * @author WhiteMonsterZeroUltraEnergy
  * @license MIT
  *
@@ -32,17 +67,50 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#define BUFFER_SIZE 1024
+#define STREAM_BUFFER_SIZE (256 * 1024)
+#define TRANSFER_CHUNK (1024 * 1024)
+#define TRANSFER_PIPE_SIZE (1024 * 1024)
+#define PUMP_CHUNKS 16                  /* per direction and wakeup, so neither starves the other */
+#define CHURN_SUB_BUCKETS 16            /* per power of two of microseconds: about 6% precision */
+#define CHURN_BUCKETS (64 * CHURN_SUB_BUCKETS)
+#define CHURN_MESSAGE "PING\r\n"       /* echoed, or answered +PONG by -m resp */
+#define HOLD_MAX_CONNECTING 4096        /* connects in flight, so the ramp cannot overrun the listen backlog */
+#define HOLD_EVENTS 1024
+#define HOLD_SLACK_FDS 64               /* stdio, epoll and friends */
+#define VERIFY_MAGIC 0x56455246u        /* "VERF" */
+#define VERIFY_POOL_SIZE (4 * 1024 * 1024)
+#define VERIFY_DEFAULT_PAYLOAD (16 * 1024)
+#define VERIFY_WINDOW (4 * 1024 * 1024) /* bytes a connection may have unverified */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define DEFAULT_SECONDS 10
 
 /* Flag to control the main loop when receiving SIGINT (Ctrl+C). */
 volatile sig_atomic_t keep_running = 1;
@@ -53,40 +121,1246 @@ void handle_sigint(int sig) {
     keep_running = 0;
 }
 
-/* It sends all data through the socket.
- * Returns 0 on success, -1 on failure, -2 if socket would block.
- */
-int send_all(const int socket, const void *msg, const size_t len) {
-    const char *data = msg;
-    size_t total_sent = 0;
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+void report(const char *verb, const uint64_t bytes, const double elapsed) {
+    fprintf(stderr, "[*] %s %.1f MB in %.2f s: %.1f Mbit/s\n", verb, (double) bytes / 1e6, elapsed,
+            elapsed > 0 ? (double) bytes * 8 / elapsed / 1e6 : 0);
+}
+
+
+/* Reads and drops for `seconds` or until the server closes; use with -m chargen. */
+void sink(const int socket, const double seconds) {
+    char *buffer = malloc(STREAM_BUFFER_SIZE);
+    uint64_t total = 0;
+
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(5);
+    }
+    const double start = now_seconds();
+    double now = start;
+    while (keep_running && now - start < seconds) {
+        const ssize_t bytes_received = read(socket, buffer, STREAM_BUFFER_SIZE);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            break;
+        }
+        if (bytes_received == 0) break;
+        total += (uint64_t) bytes_received;
+        now = now_seconds();
+    }
+    report("Received", total, now_seconds() - start);
+    free(buffer);
+}
 
-    while (total_sent < len) {
-        const ssize_t bytes_sent = write(socket, data + total_sent, len - total_sent);
+
+/* Writes a fixed buffer for `seconds`; use with -m discard. */
+void source(const int socket, const double seconds) {
+    char *buffer = malloc(STREAM_BUFFER_SIZE);
+    uint64_t total = 0;
+
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(5);
+    }
+    memset(buffer, 'x', STREAM_BUFFER_SIZE);
+    const double start = now_seconds();
+    double now = start;
+    while (keep_running && now - start < seconds) {
+        const ssize_t bytes_sent = write(socket, buffer, STREAM_BUFFER_SIZE);
         if (bytes_sent < 0) {
             if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+            perror("write");
+            break;
+        }
+        total += (uint64_t) bytes_sent;
+        now = now_seconds();
+    }
+    report("Sent", total, now_seconds() - start);
+    free(buffer);
+}
+
+
+/* Bytes on their way from one descriptor to another. */
+struct buffer {
+    char data[STREAM_BUFFER_SIZE];
+    size_t len;
+};
+
+
+/* Writes everything to a blocking descriptor. Returns -1 on error. */
+int write_all(const int fd, const char *data, size_t len) {
+    while (len) {
+        const ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+
+/* Passes the complete lines of the buffer to stdout and keeps the partial
+ * one; everything goes once the buffer is full or at the end.
+ */
+int flush_lines(struct buffer *in, const bool all) {
+    size_t len = in->len;
+
+    if (!all && len < sizeof(in->data)) {
+        const char *nl = memrchr(in->data, '\n', len);
+        len = nl ? (size_t) (nl - in->data) + 1 : 0;
+    }
+    if (len == 0) return 0;
+    if (write_all(STDOUT_FILENO, in->data, len)) return -1;
+    in->len -= len;
+    memmove(in->data, in->data + len, in->len);
+    return 0;
+}
+
+
+/* Asks epoll for readiness on fd, or stops asking with events 0. */
+int watch(const int epoll_fd, const int fd, const uint32_t events, uint32_t *current) {
+    if (events == *current) return 0;
+    const int op = *current == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    struct epoll_event event = { .events = events, .data.fd = fd };
+    if (epoll_ctl(epoll_fd, op, fd, &event)) return -1;
+    *current = events;
+    return 0;
+}
+
+
+/* Streams stdin to the socket and the socket to stdout until the server
+ * closes. At the end of stdin the socket is shut for writing, so an echo
+ * server can finish and close its side. Typing "exit" on a terminal ends
+ * the connection at once.
+ */
+void duplex(const int socket) {
+    struct buffer *out = malloc(sizeof(*out));
+    struct buffer *in = malloc(sizeof(*in));
+    const bool interactive = isatty(STDIN_FILENO);
+    uint32_t stdin_events = 0;
+    uint32_t socket_events = 0;
+    bool stdin_open = true;
+    bool stdin_pollable = true;     /* a regular file cannot be watched, and never blocks */
+    bool sending = true;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (out == NULL || in == NULL || epoll_fd == -1) {
+        perror("duplex");
+        exit(5);
+    }
+    out->len = in->len = 0;
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    if (interactive) fprintf(stdout, "Type \"exit\" to end the connection.\n");
+
+    const double start = now_seconds();
+    while (keep_running) {
+        /* Read stdin only while there is room to put it. */
+        const uint32_t want_stdin = stdin_open && out->len < sizeof(out->data) ? EPOLLIN : 0;
+        if (stdin_pollable && watch(epoll_fd, STDIN_FILENO, want_stdin, &stdin_events)) {
+            if (errno != EPERM) {
+                perror("epoll_ctl");
+                break;
+            }
+            stdin_pollable = false;
+        }
+        const uint32_t want_socket = EPOLLIN | EPOLLRDHUP | (out->len ? EPOLLOUT : 0);
+        if (watch(epoll_fd, socket, want_socket, &socket_events)) {
+            perror("epoll_ctl");
+            break;
+        }
+
+        struct epoll_event events[2];
+        const bool stdin_ready_now = !stdin_pollable && want_stdin;
+        const int ready = epoll_wait(epoll_fd, events, 2, stdin_ready_now ? 0 : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        bool stdin_ready = stdin_ready_now;
+        uint32_t socket_ready = 0;
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.fd == STDIN_FILENO) stdin_ready = true;
+            else socket_ready = events[i].events;
+        }
+
+        if (stdin_ready) {
+            const ssize_t n = read(STDIN_FILENO, out->data + out->len, sizeof(out->data) - out->len);
+            if (n == -1 && errno != EINTR && errno != EAGAIN) {
+                perror("read");
+                break;
+            }
+            if (n == 0) stdin_open = false;
+            if (n > 0 && interactive && strncmp(out->data + out->len, "exit", 4) == 0) break;
+            if (n > 0) out->len += (size_t) n;
+        }
+
+        if (out->len && (socket_ready & EPOLLOUT || stdin_ready)) {
+            const ssize_t n = write(socket, out->data, out->len);
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("write");
+                break;
+            }
+            if (n > 0) {
+                sent += (uint64_t) n;
+                out->len -= (size_t) n;
+                memmove(out->data, out->data + n, out->len);
+            }
+        }
+        if (sending && !stdin_open && out->len == 0) {
+            shutdown(socket, SHUT_WR);
+            sending = false;
+        }
+
+        if (socket_ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            const ssize_t n = read(socket, in->data + in->len, sizeof(in->data) - in->len);
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("read");
+                break;
+            }
+            if (n > 0) {
+                received += (uint64_t) n;
+                in->len += (size_t) n;
+            }
+            if (flush_lines(in, n == 0)) {
+                perror("write");
+                break;
+            }
+            if (n == 0) break;
+        }
+    }
+    flush_lines(in, true);
+    if (!interactive) {
+        const double elapsed = now_seconds() - start;
+        report("Sent", sent, elapsed);
+        report("Received", received, elapsed);
+    }
+    close(epoll_fd);
+    free(out);
+    free(in);
+}
+
+
+/* How the input reaches the socket, and the socket stdout. */
+enum path {
+    PATH_SENDFILE,      /* input is a regular file */
+    PATH_SPLICE,        /* straight between a pipe and the socket */
+    PATH_PIPE,          /* socket into a pipe of our own, and on into a file */
+    PATH_COPY,          /* read() and write() */
+};
+
+/* What the sending side waits for. */
+enum send_state {
+    SEND_INPUT,
+    SEND_SOCKET,
+    SEND_DONE,
+};
+
+struct transfer {
+    int socket;
+    int in_fd;
+    enum path in_path;
+    enum path out_path;
+    enum send_state state;
+    int pipe[2];                /* for PATH_PIPE */
+    char *buffer;               /* for PATH_COPY */
+    size_t buffered;            /* read from the input, not sent yet */
+    uint64_t sent;
+    uint64_t received;
+};
+
+
+enum path input_path(const int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) return PATH_COPY;
+    if (S_ISREG(st.st_mode)) return PATH_SENDFILE;
+    if (S_ISFIFO(st.st_mode)) return PATH_SPLICE;
+    return PATH_COPY;
+}
+
+
+enum path output_path(const int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) return PATH_COPY;
+    if (S_ISFIFO(st.st_mode)) return PATH_SPLICE;
+    if (S_ISREG(st.st_mode)) return PATH_PIPE;
+    return PATH_COPY;
+}
+
+
+/* Moves input to the socket until one of them has to be waited for. */
+int pump_send(struct transfer *t) {
+    for (int i = 0; i < PUMP_CHUNKS; ++i) {
+        ssize_t n;
+        if (t->in_path == PATH_SENDFILE) n = sendfile(t->socket, t->in_fd, NULL, TRANSFER_CHUNK);
+        else if (t->in_path == PATH_SPLICE) {
+            n = splice(t->in_fd, NULL, t->socket, NULL, TRANSFER_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        else {
+            /* One read per wakeup: a terminal or device may not have more. */
+            if (t->buffered == 0) {
+                if (t->state != SEND_INPUT) {
+                    t->state = SEND_INPUT;
+                    return 0;
+                }
+                n = read(t->in_fd, t->buffer, STREAM_BUFFER_SIZE);
+                if (n == -1 && errno == EINTR) continue;
+                if (n == -1) return -1;
+                if (n == 0) goto done;
+                t->buffered = (size_t) n;
+            }
+            n = write(t->socket, t->buffer, t->buffered);
+            if (n > 0) {
+                t->buffered -= (size_t) n;
+                memmove(t->buffer, t->buffer + n, t->buffered);
+                t->sent += (uint64_t) n;
+                t->state = t->buffered ? SEND_SOCKET : SEND_INPUT;
+                if (t->state == SEND_INPUT) return 0;
+                continue;
+            }
+        }
+
+        if (n > 0) {
+            t->sent += (uint64_t) n;
+            t->state = SEND_INPUT;
+            continue;
+        }
+        if (n == 0) goto done;
+        if (errno == EINTR) continue;
+        if (errno == EINVAL || errno == ENOSYS) {
+            /* This pair of descriptors cannot do it: copy instead. */
+            if (t->in_path == PATH_COPY) return -1;
+            t->in_path = PATH_COPY;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+        /* A pipe splice cannot say which side was not ready: ask the pipe. */
+        struct pollfd input = { .fd = t->in_fd, .events = POLLIN };
+        t->state = t->in_path == PATH_SPLICE && poll(&input, 1, 0) == 0 ? SEND_INPUT : SEND_SOCKET;
+        return 0;
+    }
+    return 0;
+
+done:
+    shutdown(t->socket, SHUT_WR);
+    t->state = SEND_DONE;
+    return 0;
+}
+
+
+/* Moves what the socket has to stdout. Returns 1 at the server's EOF. */
+int pump_receive(struct transfer *t) {
+    for (int i = 0; i < PUMP_CHUNKS; ++i) {
+        ssize_t n;
+        if (t->out_path == PATH_SPLICE) n = splice(t->socket, NULL, STDOUT_FILENO, NULL, TRANSFER_CHUNK, SPLICE_F_MOVE);
+        else if (t->out_path == PATH_PIPE) {
+            n = splice(t->socket, NULL, t->pipe[1], NULL, TRANSFER_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            for (ssize_t left = n; left > 0;) {
+                const ssize_t moved = splice(t->pipe[0], NULL, STDOUT_FILENO, NULL, (size_t) left, SPLICE_F_MOVE);
+                if (moved > 0) left -= moved;
+                else if (moved == -1 && errno == EINTR) continue;
+                else {
+                    /* A file that refuses splice, such as one opened O_APPEND: copy from here on. */
+                    char *chunk = malloc((size_t) left);
+                    if (chunk == NULL || read(t->pipe[0], chunk, (size_t) left) != left
+                        || write_all(STDOUT_FILENO, chunk, (size_t) left)) {
+                        free(chunk);
+                        return -1;
+                    }
+                    free(chunk);
+                    t->out_path = PATH_COPY;
+                    left = 0;
+                }
+            }
+        }
+        else {
+            n = read(t->socket, t->buffer + STREAM_BUFFER_SIZE, STREAM_BUFFER_SIZE);
+            if (n > 0 && write_all(STDOUT_FILENO, t->buffer + STREAM_BUFFER_SIZE, (size_t) n)) return -1;
+        }
+
+        if (n > 0) {
+            t->received += (uint64_t) n;
+            continue;
+        }
+        if (n == 0) return 1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EINVAL && t->out_path != PATH_COPY) {
+            t->out_path = PATH_COPY;
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Netcat mode: streams the input to the server and the server to stdout,
+ * both ways at once, until the server closes. The socket is shut for
+ * writing at the end of the input.
+ */
+void transfer(const int socket, const int in_fd) {
+    struct transfer t = {
+        .socket = socket,
+        .in_fd = in_fd,
+        .in_path = input_path(in_fd),
+        .out_path = output_path(STDOUT_FILENO),
+        .state = SEND_INPUT,
+        .pipe = { -1, -1 },
+        .buffer = malloc(2 * STREAM_BUFFER_SIZE),   /* input, then output, for PATH_COPY */
+    };
+    uint32_t input_events = 0;
+    uint32_t socket_events = 0;
+    bool input_pollable = t.in_path != PATH_SENDFILE;
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (t.buffer == NULL || epoll_fd == -1) {
+        perror("transfer");
+        exit(5);
+    }
+    if (t.out_path == PATH_PIPE && pipe2(t.pipe, O_CLOEXEC)) t.out_path = PATH_COPY;
+    /* Bigger pipes: fewer, larger splices. Not allowed everywhere; it is only an optimization. */
+    if (t.pipe[1] != -1) fcntl(t.pipe[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+    if (t.in_path == PATH_SPLICE) fcntl(in_fd, F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+    if (t.out_path == PATH_SPLICE) fcntl(STDOUT_FILENO, F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+    const double start = now_seconds();
+    while (keep_running) {
+        const uint32_t want_input = t.state == SEND_INPUT ? EPOLLIN : 0;
+        if (input_pollable && watch(epoll_fd, in_fd, want_input, &input_events)) {
+            if (errno != EPERM) {
+                perror("epoll_ctl");
+                break;
+            }
+            input_pollable = false;
+        }
+        const uint32_t want_socket = EPOLLIN | EPOLLRDHUP | (t.state == SEND_SOCKET ? EPOLLOUT : 0);
+        if (watch(epoll_fd, socket, want_socket, &socket_events)) {
+            perror("epoll_ctl");
+            break;
+        }
+
+        struct epoll_event events[2];
+        const bool input_ready_now = !input_pollable && want_input;
+        const int ready = epoll_wait(epoll_fd, events, 2, input_ready_now ? 0 : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        bool input_ready = input_ready_now;
+        uint32_t socket_ready = 0;
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.fd == in_fd) input_ready = true;
+            else socket_ready = events[i].events;
+        }
+
+        if ((t.state == SEND_INPUT && input_ready) || (t.state == SEND_SOCKET && socket_ready & EPOLLOUT)) {
+            if (pump_send(&t)) {
+                perror("send");
+                break;
+            }
+        }
+        if (socket_ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            const int rc = pump_receive(&t);
+            if (rc == -1) perror("receive");
+            if (rc) break;
+        }
+    }
+
+    const double elapsed = now_seconds() - start;
+    report("Sent", t.sent, elapsed);
+    report("Received", t.received, elapsed);
+    if (t.pipe[0] != -1) {
+        close(t.pipe[0]);
+        close(t.pipe[1]);
+    }
+    close(epoll_fd);
+    free(t.buffer);
+}
+
+
+/* How a churn connection ends. */
+enum churn_close {
+    CLOSE_NORMAL,       /* close() first: the client holds TIME_WAIT */
+    CLOSE_ABORT,        /* SO_LINGER 0: a reset, and no TIME_WAIT anywhere */
+    CLOSE_WAIT,         /* shut down writing and wait for the server to close: it holds TIME_WAIT */
+};
+
+struct churn {
+    pthread_t thread;
+    const struct sockaddr_in *addr;
+    double deadline;
+    bool exchange;
+    enum churn_close close_mode;
+    uint64_t connects;
+    uint64_t failures;
+    int last_errno;
+    uint64_t max_us;
+    uint64_t buckets[CHURN_BUCKETS];    /* connect latency */
+};
+
+
+/* Log-linear: exact below CHURN_SUB_BUCKETS, then CHURN_SUB_BUCKETS steps per power of two. */
+unsigned churn_bucket(const uint64_t us) {
+    if (us < CHURN_SUB_BUCKETS) return (unsigned) us;
+    const unsigned msb = 63 - (unsigned) __builtin_clzll(us);
+    const unsigned sub = (unsigned) (us >> (msb - 4)) & (CHURN_SUB_BUCKETS - 1);
+    return (msb - 3) * CHURN_SUB_BUCKETS + sub;
+}
+
+
+/* The smallest value that lands in the bucket. */
+uint64_t churn_bucket_floor(const unsigned bucket) {
+    if (bucket < CHURN_SUB_BUCKETS) return bucket;
+    const unsigned msb = bucket / CHURN_SUB_BUCKETS + 3;
+    return (uint64_t) (CHURN_SUB_BUCKETS + bucket % CHURN_SUB_BUCKETS) << (msb - 4);
+}
+
+
+/* One connection, start to end. Returns -1 with errno set if it failed. */
+int churn_once(struct churn *c) {
+    static const struct linger abort_linger = { 1, 0 };
+    char reply[256];
+
+    const double start = now_seconds();
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (c->close_mode == CLOSE_ABORT) setsockopt(fd, SOL_SOCKET, SO_LINGER, &abort_linger, sizeof(abort_linger));
+    if (connect(fd, (const struct sockaddr *) c->addr, sizeof(*c->addr)) == -1) goto fail;
+
+    const uint64_t us = (uint64_t) ((now_seconds() - start) * 1e6);
+    c->buckets[churn_bucket(us)]++;
+    if (us > c->max_us) c->max_us = us;
+
+    if (c->exchange) {
+        size_t got = 0;
+        if (write_all(fd, CHURN_MESSAGE, sizeof(CHURN_MESSAGE) - 1)) goto fail;
+        while (got == 0 || reply[got - 1] != '\n') {
+            const ssize_t n = read(fd, reply + got, sizeof(reply) - got);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0 || (got += (size_t) n) == sizeof(reply)) {
+                if (n == 0) errno = ECONNRESET;
+                goto fail;
+            }
+        }
+    }
+    if (c->close_mode == CLOSE_WAIT) {
+        shutdown(fd, SHUT_WR);
+        while (read(fd, reply, sizeof(reply)) > 0) {}
+    }
+    close(fd);
+    return 0;
+
+fail:;
+    const int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+
+void *churn_run(void *arg) {
+    struct churn *c = arg;
+
+    while (keep_running && now_seconds() < c->deadline) {
+        if (churn_once(c) == 0) c->connects++;
+        else {
+            c->failures++;
+            c->last_errno = errno;
+        }
+    }
+    return NULL;
+}
+
+
+uint64_t churn_percentile(const uint64_t *buckets, const uint64_t total, const double p) {
+    const uint64_t rank = (uint64_t) ((double) total * p);
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < CHURN_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen > rank) return churn_bucket_floor(i);
+    }
+    return 0;
+}
+
+
+/* Churn mode: `threads` threads connect and close for `seconds`, then the
+ * totals and the connect latency percentiles are reported.
+ */
+void churn(const struct sockaddr_in *addr, const unsigned threads, const double seconds, const bool exchange,
+           const enum churn_close close_mode) {
+    struct churn *workers = calloc(threads, sizeof(*workers));
+    uint64_t *buckets = calloc(CHURN_BUCKETS, sizeof(*buckets));
+    uint64_t connects = 0;
+    uint64_t failures = 0;
+    uint64_t max_us = 0;
+    int last_errno = 0;
+
+    if (workers == NULL || buckets == NULL) {
+        perror("calloc");
+        exit(5);
+    }
+    const double start = now_seconds();
+    for (unsigned i = 0; i < threads; ++i) {
+        workers[i].addr = addr;
+        workers[i].deadline = start + seconds;
+        workers[i].exchange = exchange;
+        workers[i].close_mode = close_mode;
+        if (pthread_create(&workers[i].thread, NULL, churn_run, &workers[i])) {
+            perror("pthread_create");
+            exit(7);
+        }
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        connects += workers[i].connects;
+        failures += workers[i].failures;
+        if (workers[i].last_errno) last_errno = workers[i].last_errno;
+        if (workers[i].max_us > max_us) max_us = workers[i].max_us;
+        for (unsigned b = 0; b < CHURN_BUCKETS; ++b) buckets[b] += workers[i].buckets[b];
+    }
+    const double elapsed = now_seconds() - start;
+
+    fprintf(stderr, "[*] %llu connections in %.2f s: %.0f connects/s, %llu failed%s%s%s\n",
+            (unsigned long long) connects, elapsed, elapsed > 0 ? (double) connects / elapsed : 0,
+            (unsigned long long) failures, last_errno ? " (last: " : "", last_errno ? strerror(last_errno) : "",
+            last_errno ? ")" : "");
+    fprintf(stderr, "[*] Connect latency: p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n",
+            (unsigned long long) churn_percentile(buckets, connects, 0.5),
+            (unsigned long long) churn_percentile(buckets, connects, 0.99),
+            (unsigned long long) churn_percentile(buckets, connects, 0.999), (unsigned long long) max_us);
+    free(buckets);
+    free(workers);
+}
+
+
+struct hold {
+    int epoll_fd;
+    const struct sockaddr_in *addr;
+    unsigned sources;                   /* 127.0.0.1 upwards; 0: let the kernel choose */
+    int *fds;                           /* every connection opened, -1 once gone */
+    unsigned opened;
+    unsigned connecting;
+    unsigned established;
+    uint64_t failed;
+    uint64_t dropped;                   /* closed by the server */
+    uint64_t replies;
+    int last_errno;
+};
+
+
+/* Raises the open-file limit to cover `count` sockets, the hard limit too if allowed. */
+int raise_nofile(const rlim_t count) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit)) return -1;
+    if (limit.rlim_cur >= count) return 0;
+    if (limit.rlim_max < count) limit.rlim_max = count;
+    limit.rlim_cur = count;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == 0) return 0;
+
+    /* Not privileged: as far as the hard limit goes. */
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    errno = EMFILE;
+    return -1;
+}
+
+
+/* The source addresses needed for `count` connections: one per port range. */
+unsigned hold_sources(const unsigned count) {
+    unsigned low = 32768;
+    unsigned high = 60999;
+    FILE *range = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+
+    if (range) {
+        if (fscanf(range, "%u %u", &low, &high) != 2) low = 32768, high = 60999;
+        fclose(range);
+    }
+    const unsigned ports = high > low ? high - low + 1 : 1;
+    return (count + ports - 1) / ports;
+}
+
+
+void hold_fail(struct hold *h, const int fd, const int error) {
+    h->failed++;
+    h->last_errno = error;
+    close(fd);
+}
+
+
+/* Starts one connect. It completes, or fails, in hold_event(). */
+void hold_open(struct hold *h) {
+    const unsigned index = h->opened++;
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    h->fds[index] = -1;
+    if (fd == -1) {
+        h->failed++;
+        h->last_errno = errno;
+        return;
+    }
+    if (h->sources) {
+        const int on = 1;
+        struct sockaddr_in source = { .sin_family = AF_INET };
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index % h->sources);
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+        if (bind(fd, (struct sockaddr *) &source, sizeof(source))) {
+            hold_fail(h, fd, errno);
+            return;
+        }
+    }
+    const int rc = connect(fd, (const struct sockaddr *) h->addr, sizeof(*h->addr));
+    if (rc == -1 && errno != EINPROGRESS) {
+        hold_fail(h, fd, errno);
+        return;
+    }
+
+    /* The index rides along, so the fd can be forgotten when it closes. */
+    struct epoll_event event = { .events = rc == 0 ? EPOLLIN | EPOLLRDHUP | EPOLLET : EPOLLOUT, .data.u64 = index };
+    if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        hold_fail(h, fd, errno);
+        return;
+    }
+    h->fds[index] = fd;
+    if (rc == 0) h->established++;
+    else h->connecting++;
+}
+
+
+void hold_event(struct hold *h, const unsigned index, const uint32_t events) {
+    const int fd = h->fds[index];
+    char buffer[4096];
+
+    if (fd == -1) return;
+    if (events & EPOLLOUT) {
+        /* A connect finished. */
+        int error = 0;
+        socklen_t len = sizeof(error);
+        h->connecting--;
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.u64 = index };
+        if (error || epoll_ctl(h->epoll_fd, EPOLL_CTL_MOD, fd, &event)) {
+            h->fds[index] = -1;
+            hold_fail(h, fd, error ? error : errno);
+            return;
+        }
+        h->established++;
+        return;
+    }
+
+    /* Replies, or the server letting go. */
+    while (true) {
+        const ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            for (const char *p = buffer; (p = memchr(p, '\n', (size_t) (buffer + n - p))); ++p) h->replies++;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        break;
+    }
+    h->fds[index] = -1;
+    h->established--;
+    h->dropped++;
+    close(fd);
+}
+
+
+/* Hold mode: ramps up to `count` connections at `rate` a second (0: as fast
+ * as HOLD_MAX_CONNECTING allows), keeps them open for `seconds` and closes
+ * them. With `exchange`, every connection sends a line once a second while
+ * held, spread over the second.
+ */
+void hold(const struct sockaddr_in *addr, const unsigned count, unsigned sources, const double rate,
+          const double seconds, const bool exchange) {
+    struct hold h = { .addr = addr, .sources = sources, .fds = malloc(count * sizeof(int)) };
+    struct epoll_event events[HOLD_EVENTS];
+
+    h.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (h.fds == NULL || h.epoll_fd == -1) {
+        perror("hold");
+        exit(5);
+    }
+    if (raise_nofile((rlim_t) count + HOLD_SLACK_FDS)) {
+        perror("setrlimit RLIMIT_NOFILE");
+        exit(8);
+    }
+    fprintf(stderr, "[*] Opening %u connections from %u source address%s.\n", count, sources ? sources : 1,
+            sources > 1 ? "es" : "");
+
+    const double start = now_seconds();
+    double held_since = 0;
+    double next_report = start + 1;
+    unsigned next_ping = 0;
+    uint64_t last_replies = 0;
+    while (keep_running) {
+        const double now = now_seconds();
+
+        /* Ramp: as many as the rate allows by now, and the backlog bounds. */
+        const double allowed = rate > 0 ? (now - start) * rate : (double) count;
+        while (h.opened < count && h.opened < allowed && h.connecting < HOLD_MAX_CONNECTING) hold_open(&h);
+        if (held_since == 0 && h.opened == count && h.connecting == 0) {
+            held_since = now;
+            fprintf(stderr, "[*] Ramp-up done in %.2f s: %u established, %llu failed.\n", now - start,
+                    h.established, (unsigned long long) h.failed);
+        }
+        if (held_since && now - held_since >= seconds) break;
+
+        if (held_since && exchange) {
+            /* Every connection once a second, a slice at a time. */
+            const double second = now - held_since;
+            const unsigned due = (unsigned) ((second - (double) (unsigned) second) * count);
+            for (; next_ping != due; next_ping = (next_ping + 1) % count) {
+                if (h.fds[next_ping] == -1) continue;
+                if (write(h.fds[next_ping], CHURN_MESSAGE, sizeof(CHURN_MESSAGE) - 1) < 0 && errno != EAGAIN) {
+                    h.last_errno = errno;
+                }
+            }
+        }
+        if (now >= next_report) {
+            fprintf(stderr, "[*] %u established, %u connecting, %llu failed, %llu dropped, %llu replies/s%s%s\n",
+                    h.established, h.connecting, (unsigned long long) h.failed, (unsigned long long) h.dropped,
+                    (unsigned long long) (h.replies - last_replies), h.last_errno ? "; last error: " : "",
+                    h.last_errno ? strerror(h.last_errno) : "");
+            last_replies = h.replies;
+            next_report += 1;
+        }
+
+        /* Wake at least every millisecond while ramping or pinging. */
+        const int timeout = h.opened < count || exchange ? 1 : 100;
+        const int ready = epoll_wait(h.epoll_fd, events, HOLD_EVENTS, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < ready; ++i) hold_event(&h, (unsigned) events[i].data.u64, events[i].events);
+    }
+
+    fprintf(stderr, "[*] Closing %u connections.\n", h.established + h.connecting);
+    for (unsigned i = 0; i < h.opened; ++i) {
+        if (h.fds[i] != -1) close(h.fds[i]);
+    }
+    close(h.epoll_fd);
+    free(h.fds);
+}
+
+
+uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+uint32_t xxh_read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+uint64_t xxh_rotl(const uint64_t value, const int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+uint64_t xxh_round(uint64_t acc, const uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+
+uint64_t xxh_merge(const uint64_t acc, const uint64_t value) {
+    return (acc ^ xxh_round(0, value)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+/* XXH64 (little-endian hosts). The four accumulators are independent, so
+ * the main loop runs four multiply chains side by side.
+ */
+uint64_t xxh64(const void *data, const size_t len, const uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *const end = p + len;
+    uint64_t hash;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; end - p >= 32; p += 32) {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        hash = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        hash = xxh_merge(hash, v1);
+        hash = xxh_merge(hash, v2);
+        hash = xxh_merge(hash, v3);
+        hash = xxh_merge(hash, v4);
+    }
+    else hash = seed + XXH_PRIME64_5;
+    hash += (uint64_t) len;
+
+    for (; end - p >= 8; p += 8) hash = xxh_rotl(hash ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    if (end - p >= 4) {
+        hash = xxh_rotl(hash ^ (uint64_t) xxh_read32(p) * XXH_PRIME64_1, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) hash = xxh_rotl(hash ^ *p * XXH_PRIME64_5, 11) * XXH_PRIME64_1;
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+struct frame_header {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t seq;
+    uint64_t hash;                      /* XXH64 of the payload, seeded with seq */
+};
+
+struct verify_conn {
+    int fd;
+    bool sending;                       /* false once time is up: only the frame under way goes out */
+    bool shut;
+    uint64_t next_send;
+    uint64_t next_check;
+    struct frame_header header;         /* of the frame being sent */
+    size_t frame_sent;                  /* of it, header included */
+    uint64_t unverified;                /* bytes sent, not yet back and checked */
+    char *in;
+    size_t in_len;
+};
+
+struct verify {
+    const char *pool;
+    size_t max_payload;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t failures;
+};
+
+
+/* Length and place in the pool follow from the sequence number alone. */
+size_t frame_len(const struct verify *v, const uint64_t seq) {
+    const uint64_t mix = (seq + 1) * 0x9E3779B97F4A7C15ULL;
+    return 1 + (size_t) ((mix >> 17) % v->max_payload);
+}
+
+
+const char *frame_payload(const struct verify *v, const uint64_t seq) {
+    const uint64_t mix = (seq + 1) * 0xC2B2AE3D27D4EB4FULL;
+    return v->pool + (mix >> 11) % (VERIFY_POOL_SIZE - v->max_payload);
+}
+
+
+/* Sends frames until the socket is full or the window is. Once sending
+ * stops, the write side is shut after the last whole frame.
+ */
+int verify_send(struct verify *v, struct verify_conn *c) {
+    while ((c->sending || c->frame_sent) && c->unverified < VERIFY_WINDOW) {
+        if (c->frame_sent == 0) {
+            const size_t len = frame_len(v, c->next_send);
+            c->header = (struct frame_header) {
+                VERIFY_MAGIC, (uint32_t) len, c->next_send, xxh64(frame_payload(v, c->next_send), len, c->next_send)
+            };
+        }
+        const size_t header_len = sizeof(c->header);
+        const size_t total = header_len + c->header.len;
+        const char *payload = frame_payload(v, c->header.seq);
+        struct iovec iov[2];
+        int n_iov = 0;
+        if (c->frame_sent < header_len) {
+            iov[n_iov++] = (struct iovec) { (char *) &c->header + c->frame_sent, header_len - c->frame_sent };
+            iov[n_iov++] = (struct iovec) { (char *) payload, c->header.len };
+        }
+        else iov[n_iov++] = (struct iovec) { (char *) payload + c->frame_sent - header_len, total - c->frame_sent };
+
+        const ssize_t n = writev(c->fd, iov, n_iov);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        c->frame_sent += (size_t) n;
+        c->unverified += (uint64_t) n;
+        if (c->frame_sent == total) {
+            c->frame_sent = 0;
+            c->next_send++;
+        }
+    }
+    if (!c->sending && c->frame_sent == 0 && !c->shut) {
+        shutdown(c->fd, SHUT_WR);
+        c->shut = true;
+    }
+    return 0;
+}
+
+
+/* Checks every complete frame that came back. Returns -1 at the first bad
+ * one: after that the stream cannot be framed again.
+ */
+int verify_check(struct verify *v, struct verify_conn *c, const unsigned index) {
+    size_t used = 0;
+
+    while (c->in_len - used >= sizeof(struct frame_header)) {
+        struct frame_header header;
+        memcpy(&header, c->in + used, sizeof(header));
+        const size_t expected_len = frame_len(v, c->next_check);
+        if (header.magic != VERIFY_MAGIC || header.seq != c->next_check || header.len != expected_len) {
+            fprintf(stderr, "[!] Connection %u: frame %llu came back as magic %08x, seq %llu, %u bytes "
+                            "(expected %zu): bytes lost or reordered.\n", index,
+                    (unsigned long long) c->next_check, header.magic, (unsigned long long) header.seq, header.len,
+                    expected_len);
             return -1;
         }
-        /* socket is closed */
-        if (bytes_sent == 0) {
+        const size_t total = sizeof(header) + header.len;
+        if (c->in_len - used < total) break;
+
+        const uint64_t hash = xxh64(c->in + used + sizeof(header), header.len, header.seq);
+        if (hash != header.hash) {
+            fprintf(stderr, "[!] Connection %u: frame %llu came back corrupted (hash %016llx, sent %016llx).\n",
+                    index, (unsigned long long) header.seq, (unsigned long long) hash,
+                    (unsigned long long) header.hash);
+            return -1;
+        }
+        used += total;
+        c->next_check++;
+        c->unverified -= total;
+        v->frames++;
+        v->bytes += total;
+    }
+    c->in_len -= used;
+    memmove(c->in, c->in + used, c->in_len);
+    return 0;
+}
+
+
+/* Verify mode: `count` connections send frames for `seconds`, then wait for
+ * every echo. Returns the number of connections that saw a bad frame or
+ * lost data.
+ */
+uint64_t verify(const struct sockaddr_in *addr, const unsigned count, const size_t max_payload, const double seconds) {
+    struct verify v = { .max_payload = max_payload };
+    struct verify_conn *conns = calloc(count, sizeof(*conns));
+    char *pool = malloc(VERIFY_POOL_SIZE);
+    const size_t in_size = 2 * (sizeof(struct frame_header) + max_payload);
+    struct epoll_event events[HOLD_EVENTS];
+    unsigned open_conns = 0;
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conns == NULL || pool == NULL || epoll_fd == -1 || max_payload + 1 > VERIFY_POOL_SIZE / 2) {
+        perror("verify");
+        exit(5);
+    }
+    /* Random bytes, so a shifted or repeated slice cannot pass for the right one. */
+    uint64_t state = (uint64_t) now_seconds() | 1;
+    for (size_t i = 0; i < VERIFY_POOL_SIZE; i += 8) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(pool + i, &state, 8);
+    }
+    v.pool = pool;
+
+    for (unsigned i = 0; i < count; ++i) {
+        struct verify_conn *c = &conns[i];
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        c->in = malloc(in_size);
+        if (c->fd == -1 || c->in == NULL || connect(c->fd, (const struct sockaddr *) addr, sizeof(*addr))) {
+            perror("connect");
+            exit(4);
+        }
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = i };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event)) {
+            perror("epoll_ctl");
+            exit(5);
+        }
+        c->sending = true;
+        open_conns++;
+    }
+
+    const double start = now_seconds();
+    bool draining = false;
+    while (open_conns) {
+        if (!draining && (!keep_running || now_seconds() - start >= seconds)) {
+            /* Stop sending; the server closes each once its echoes are out. */
+            draining = true;
+            for (unsigned i = 0; i < count; ++i) {
+                if (conns[i].fd == -1) continue;
+                conns[i].sending = false;
+                /* Shuts the write side now unless a frame is half sent; errors show on the next read. */
+                verify_send(&v, &conns[i]);
+            }
+        }
+        const int ready = epoll_wait(epoll_fd, events, HOLD_EVENTS, 100);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
             break;
         }
-        total_sent += (size_t) bytes_sent;
+        for (int i = 0; i < ready; ++i) {
+            const unsigned index = events[i].data.u32;
+            struct verify_conn *c = &conns[index];
+            bool failed = false;
+            bool eof = false;
+
+            if (c->fd == -1) continue;
+            while (!failed && !eof) {
+                const ssize_t n = read(c->fd, c->in + c->in_len, in_size - c->in_len);
+                if (n > 0) {
+                    c->in_len += (size_t) n;
+                    failed = verify_check(&v, c, index) != 0;
+                    continue;
+                }
+                if (n == 0) eof = true;
+                else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) failed = true;
+                else if (errno != EINTR) break;
+            }
+            /* Sending resumes as the window drains, not only on EPOLLOUT. */
+            if (!failed && !eof && verify_send(&v, c)) failed = true;
+
+            if (eof && !failed && (c->unverified || !c->shut)) {
+                fprintf(stderr, "[!] Connection %u: closed by the server with %llu bytes never echoed back.\n",
+                        index, (unsigned long long) c->unverified);
+                failed = true;
+            }
+            if (failed || eof) {
+                if (failed) v.failures++;
+                close(c->fd);
+                c->fd = -1;
+                open_conns--;
+            }
+        }
+    }
+
+    const double elapsed = now_seconds() - start;
+    fprintf(stderr, "[*] Verified %llu frames, %.1f MB in %.2f s: %.1f Mbit/s, %llu connection%s failed.\n",
+            (unsigned long long) v.frames, (double) v.bytes / 1e6, elapsed,
+            elapsed > 0 ? (double) v.bytes * 8 / elapsed / 1e6 : 0, (unsigned long long) v.failures,
+            v.failures == 1 ? "" : "s");
+    for (unsigned i = 0; i < count; ++i) {
+        if (conns[i].fd != -1) close(conns[i].fd);
+        free(conns[i].in);
     }
-    return (total_sent == len) ? 0 : -1;
+    close(epoll_fd);
+    free(conns);
+    free(pool);
+    return v.failures;
+}
+
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s | -o | -n [-i file] | -c threads [-e] [-L close|abort|wait]\n"
+                    "        | -H connections [-e] [-A sources] [-R rate] | -V connections [-z bytes]] [-T seconds] <ip> <port>\n"
+                    "  -s  sink: receive as fast as possible (server -m chargen)\n"
+                    "  -o  source: send as fast as possible (server -m discard)\n"
+                    "  -n  netcat: stream stdin, or the -i file, to the server and its replies to stdout\n"
+                    "  -c  churn: connect and close from this many threads; -e exchanges a line on each,\n"
+                    "      -L picks the close: close (TIME_WAIT here), abort (reset) or wait (TIME_WAIT at the server)\n"
+                    "  -H  hold: open this many connections, -R a second, from -A addresses 127.0.0.1 upwards\n"
+                    "      (by default as many as the port range needs), and keep them -T seconds; -e pings each every second\n"
+                    "  -V  verify: send numbered, hashed frames of up to -z bytes on this many connections\n"
+                    "      and check that every byte comes back (server -m echo); exits 9 on a mismatch\n",
+            name);
+    exit(1);
 }
 
 
 int main(const int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <ip> <port>\n", argv[0]);
-        exit(1);
+    char mode = 0;
+    double seconds = DEFAULT_SECONDS;
+    const char *input = NULL;
+    unsigned churn_threads = 0;
+    bool exchange = false;
+    enum churn_close close_mode = CLOSE_NORMAL;
+    unsigned hold_count = 0;
+    int sources = -1;
+    double rate = 0;
+    unsigned verify_count = 0;
+    size_t max_payload = VERIFY_DEFAULT_PAYLOAD;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sonT:i:c:eL:H:A:R:V:z:")) != -1) {
+        switch (opt) {
+            case 's':
+            case 'o':
+            case 'n':
+                mode = (char) opt;
+                break;
+            case 'i':
+                input = optarg;
+                break;
+            case 'c':
+                mode = 'c';
+                churn_threads = (unsigned) atoi(optarg);
+                break;
+            case 'e':
+                exchange = true;
+                break;
+            case 'H':
+                mode = 'H';
+                hold_count = (unsigned) atoi(optarg);
+                break;
+            case 'A':
+                sources = atoi(optarg);
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'V':
+                mode = 'V';
+                verify_count = (unsigned) atoi(optarg);
+                break;
+            case 'z':
+                max_payload = (size_t) atol(optarg);
+                break;
+            case 'L':
+                if (strcmp(optarg, "close") == 0) close_mode = CLOSE_NORMAL;
+                else if (strcmp(optarg, "abort") == 0) close_mode = CLOSE_ABORT;
+                else if (strcmp(optarg, "wait") == 0) close_mode = CLOSE_WAIT;
+                else usage(argv[0]);
+                break;
+            case 'T':
+                seconds = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || (input && mode != 'n') || (mode == 'c' && churn_threads == 0)
+        || (mode == 'H' && hold_count == 0) || (mode == 'V' && (verify_count == 0 || max_payload == 0))) {
+        usage(argv[0]);
     }
 
     struct sockaddr_in server_addr;
-    char buffer[BUFFER_SIZE];
-    const char *SERVER_IP = argv[1];
-    const uint16_t PORT = (uint16_t)atoi(argv[2]);
+    const char *SERVER_IP = argv[optind];
+    const uint16_t PORT = (uint16_t)atoi(argv[optind + 1]);
 
     /* Resolve the hostname to an IP address. */
     const struct hostent *server = gethostbyname(SERVER_IP);
@@ -108,39 +1382,51 @@ int main(const int argc, char *argv[]) {
     server_addr.sin_addr = *((struct in_addr *) server->h_addr);
     memset(&(server_addr.sin_zero), '\0', 8);
 
+    if (mode == 'c') {
+        close(client_fd);
+        signal(SIGINT, handle_sigint);
+        signal(SIGPIPE, SIG_IGN);
+        churn(&server_addr, churn_threads, seconds, exchange, close_mode);
+        return 0;
+    }
+    if (mode == 'H') {
+        close(client_fd);
+        signal(SIGINT, handle_sigint);
+        signal(SIGPIPE, SIG_IGN);
+        /* Other sources than 127.0.0.1 only make sense towards loopback. */
+        const bool loopback = (ntohl(server_addr.sin_addr.s_addr) >> 24) == 127;
+        if (sources < 0) sources = loopback ? (int) hold_sources(hold_count) : 0;
+        hold(&server_addr, hold_count, (unsigned) sources, rate, seconds, exchange);
+        return 0;
+    }
+    if (mode == 'V') {
+        close(client_fd);
+        signal(SIGINT, handle_sigint);
+        signal(SIGPIPE, SIG_IGN);
+        return verify(&server_addr, verify_count, max_payload, seconds) ? 9 : 0;
+    }
+
     /* Attempt to connect to the server. */
     if (connect(client_fd, (struct sockaddr *)&server_addr,sizeof(struct sockaddr)) == -1) {
         perror("connect");
         exit(4);
     }
 
-    fprintf(stderr, "[*] [%s:%d] Connected to server.\n", SERVER_IP, PORT);
-    fprintf(stdout, "Type \"exit\" to end the connection.\n");
-    /* Main loop.*/
-    while (keep_running) {
-        fprintf(stdout, "> ");
-        if (!fgets(buffer, BUFFER_SIZE, stdin)) break;
-        if (strncmp(buffer, "exit", 4) == 0) break;
-
-        /* Send user input to server. */
-        if (send_all(client_fd, buffer, strlen(buffer)) < 0) {
-            perror("send_all");
-            continue;
-        }
-
-        /* Receive response from server. */
-        const ssize_t bytes_received = read(client_fd, buffer, BUFFER_SIZE);
-        if (bytes_received == -1) {
-            perror("recv");
-        }else if (bytes_received == 0) {
-            break;
-        }
-        else {
-            buffer[bytes_received] = '\0';
-            fprintf(stdout, "%s", buffer);
-        }
+    const int in_fd = input ? open(input, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (in_fd == -1) {
+        perror(input);
+        exit(6);
     }
 
+    fprintf(stderr, "[*] [%s:%d] Connected to server.\n", SERVER_IP, PORT);
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
+    if (mode == 's') sink(client_fd, seconds);
+    else if (mode == 'o') source(client_fd, seconds);
+    else if (mode == 'n') transfer(client_fd, in_fd);
+    else duplex(client_fd);
+    if (input) close(in_fd);
+
     /* Shutdown and close the socket. */
     shutdown(client_fd, SHUT_RDWR);
     close(client_fd);
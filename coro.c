@@ -0,0 +1,193 @@
+/**
+ * @file coro.c
+ *
+ * @brief Stackful coroutines for writing handlers in a blocking style.
+ *
+ * On x86-64 the switch saves the callee-saved registers and the FPU control
+ * words on the old stack and pops them from the new one: a handful of moves,
+ * no syscall. Other architectures fall back to ucontext, which also saves and
+ * restores the signal mask with a syscall on every switch.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "coro.h"
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+
+struct coro {
+#if defined(__x86_64__)
+    void *sp;                   /* saved stack pointer while not running */
+    void *caller_sp;            /* resumer's stack pointer while running */
+#else
+    ucontext_t context;
+    ucontext_t caller;
+#endif
+    coro_fn fn;
+    void *arg;
+    bool done;
+    struct coro *next_free;
+    char *mapping;              /* guard page followed by the stack */
+};
+
+static size_t page_size;
+static _Thread_local struct coro *free_list;
+static _Thread_local unsigned free_count;
+static _Thread_local struct coro *running;
+
+
+#if defined(__x86_64__)
+/* void coro_switch(void **save_sp, void *load_sp) */
+void coro_switch(void **save_sp, void *load_sp);
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n"
+);
+#endif
+
+
+/* First frame of every coroutine. Never returns: a finished coroutine
+ * switches back to its resumer for the last time.
+ */
+static void coro_entry(void) {
+    struct coro *co = running;
+
+    co->fn(co, co->arg);
+    co->done = true;
+#if defined(__x86_64__)
+    coro_switch(&co->sp, co->caller_sp);
+#else
+    swapcontext(&co->context, &co->caller);
+#endif
+    abort();
+}
+
+
+static struct coro *stack_take(void) {
+    struct coro *co = free_list;
+    if (co) {
+        free_list = co->next_free;
+        free_count--;
+        return co;
+    }
+
+    if (page_size == 0) page_size = (size_t) sysconf(_SC_PAGESIZE);
+    char *mapping = mmap(NULL, page_size + CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    if (mprotect(mapping, page_size, PROT_NONE) == -1) {
+        munmap(mapping, page_size + CORO_STACK_SIZE);
+        return NULL;
+    }
+
+    /* The control block sits at the very top of its own stack. */
+    co = (struct coro *) (mapping + page_size + CORO_STACK_SIZE) - 1;
+    co->mapping = mapping;
+    return co;
+}
+
+
+struct coro *coro_create(const coro_fn fn, void *arg) {
+    struct coro *co = stack_take();
+    if (co == NULL) return NULL;
+
+    co->fn = fn;
+    co->arg = arg;
+    co->done = false;
+
+    /* Usable stack runs from the guard page up to the control block. */
+    char *top = (char *) ((uintptr_t) co & ~(uintptr_t) 15);
+#if defined(__x86_64__)
+    uint64_t *sp = (uint64_t *) top;
+    uint32_t mxcsr;
+    uint16_t fpucw;
+    __asm__ volatile("stmxcsr %0\n\tfnstcw %1" : "=m"(mxcsr), "=m"(fpucw));
+
+    *--sp = 0;                              /* fake return address: entry sees a called frame */
+    *--sp = (uint64_t) (uintptr_t) coro_entry;
+    for (int i = 0; i < 6; ++i) *--sp = 0;  /* rbp rbx r12 r13 r14 r15 */
+    *--sp = (uint64_t) fpucw << 32 | mxcsr;
+    co->sp = sp;
+#else
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = co->mapping + page_size;
+    co->context.uc_stack.ss_size = (size_t) (top - (co->mapping + page_size));
+    co->context.uc_link = NULL;
+    makecontext(&co->context, coro_entry, 0);
+#endif
+    return co;
+}
+
+
+void coro_resume(struct coro *co) {
+    struct coro *previous = running;
+
+    running = co;
+#if defined(__x86_64__)
+    coro_switch(&co->caller_sp, co->sp);
+#else
+    swapcontext(&co->caller, &co->context);
+#endif
+    running = previous;
+}
+
+
+void coro_yield(struct coro *co) {
+#if defined(__x86_64__)
+    coro_switch(&co->sp, co->caller_sp);
+#else
+    swapcontext(&co->context, &co->caller);
+#endif
+}
+
+
+bool coro_done(const struct coro *co) {
+    return co->done;
+}
+
+
+void coro_destroy(struct coro *co) {
+    if (co == NULL) return;
+    if (free_count < CORO_POOL_SIZE) {
+        co->next_free = free_list;
+        free_list = co;
+        free_count++;
+        return;
+    }
+    munmap(co->mapping, page_size + CORO_STACK_SIZE);
+}
@@ -0,0 +1,48 @@
+/**
+ * @file coro.h
+ *
+ * @brief Stackful coroutines for writing handlers in a blocking style.
+ *
+ * A coroutine runs on its own fixed-size stack, taken from a per-thread pool
+ * and guarded by an inaccessible page, so an overflow faults instead of
+ * corrupting a neighbour. Only one coroutine runs at a time on a thread; it
+ * gives the thread back with coro_yield().
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdbool.h>
+
+/* Usable stack per coroutine; with the guard page this is the most one
+ * suspended handler can cost. */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/* Stacks each thread keeps for reuse instead of unmapping them. */
+#define CORO_POOL_SIZE 256
+
+struct coro;
+
+typedef void (*coro_fn)(struct coro *co, void *arg);
+
+/* Prepares fn(co, arg) to run on the first coro_resume(). Returns NULL on failure. */
+struct coro *coro_create(coro_fn fn, void *arg);
+
+/* Runs the coroutine until it yields or returns. */
+void coro_resume(struct coro *co);
+
+/* Called from inside the coroutine: switches back to whoever resumed it. */
+void coro_yield(struct coro *co);
+
+bool coro_done(const struct coro *co);
+
+/* Gives the stack back to the calling thread's pool. A suspended coroutine
+ * is simply dropped; it must not own anything but its stack. */
+void coro_destroy(struct coro *co);
+
+#endif /* CORO_H */
@@ -0,0 +1,517 @@
+/**
+ * @file file.c
+ *
+ * @brief Static file mode: serves files under a root directory with sendfile().
+ *
+ * A request is either an HTTP GET or HEAD, answered with keep-alive, or a
+ * bare path line, answered with the raw file and then a close. The file is
+ * sent with sendfile() straight from the page cache; where the file system
+ * refuses, the connection falls back to splicing through a pipe of its own.
+ *
+ * Each reactor keeps the files it has opened, with their sizes, so a hot
+ * file costs no open() or fstat(). An inotify watch on every cached file
+ * drops it from the cache as soon as it is written, truncated, renamed or
+ * unlinked; transfers already running finish on the old descriptor.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "cache.h"
+#include "http.h"
+#include "server.h"
+
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_MAX 4096
+#define INDEX_FILE "index.html"
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF | IN_DONT_FOLLOW)
+
+const char *file_root = ".";
+
+/* An open file. The cache holds one reference while the file is in it,
+ * and every transfer of it one more.
+ */
+struct file {
+    struct file *next;          /* bucket chain */
+    uint64_t hash;
+    char *path;                 /* relative to the root */
+    int fd;
+    off_t size;
+    int wd;                     /* inotify watch */
+    unsigned refs;
+    bool cached;
+};
+
+/* One per reactor, used only by its thread. */
+struct file_cache {
+    struct watch watch;         /* the inotify descriptor */
+    int root_fd;
+    unsigned count;
+    struct file *buckets[FILE_CACHE_BUCKETS];
+};
+
+/* Per connection: the response body being sent, if any. */
+struct transfer {
+    struct file *file;          /* NULL between responses */
+    off_t offset;
+    off_t end;
+    int pipe[2];                /* splice fallback, made on first need */
+    size_t piped;               /* bytes sitting in the pipe */
+};
+
+
+static void file_put(struct file *file) {
+    if (--file->refs) return;
+    close(file->fd);
+    free(file->path);
+    free(file);
+}
+
+
+static void file_uncache(struct file_cache *files, struct file *file) {
+    struct file **link = &files->buckets[file->hash % FILE_CACHE_BUCKETS];
+    while (*link != file) link = &(*link)->next;
+    *link = file->next;
+    file->cached = false;
+    files->count--;
+    file_put(file);
+}
+
+
+/* Drops every cached path the watch covers; hard links share one watch. */
+static void on_inotify(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct file_cache *files = container_of(watch, struct file_cache, watch);
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        const ssize_t len = read(watch->fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) continue;
+            return;
+        }
+        for (char *p = buffer; p < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            bool found = false;
+            for (unsigned i = 0; i < FILE_CACHE_BUCKETS; ++i) {
+                for (struct file *file = files->buckets[i], *next; file; file = next) {
+                    next = file->next;
+                    if (file->wd != event->wd) continue;
+                    file_uncache(files, file);
+                    found = true;
+                }
+            }
+            if (found && !(event->mask & IN_IGNORED)) inotify_rm_watch(watch->fd, event->wd);
+            p += sizeof(*event) + event->len;
+        }
+    }
+}
+
+
+/* Made on first use by the reactor's own thread. Without inotify nothing
+ * is cached, as nothing could tell when an entry went stale.
+ */
+static struct file_cache *reactor_files(struct reactor *reactor) {
+    if (reactor->files) return reactor->files;
+
+    struct file_cache *files = calloc(1, sizeof(*files));
+    if (files == NULL) return NULL;
+    files->root_fd = open(file_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (files->root_fd == -1) {
+        perror(file_root);
+        free(files);
+        return NULL;
+    }
+    files->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    files->watch.on_event = on_inotify;
+    if (files->watch.fd != -1) {
+        struct epoll_event epoll_event = { .events = EPOLLIN, .data.ptr = &files->watch };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, files->watch.fd, &epoll_event) == -1) {
+            perror("epoll_ctl");
+            close(files->watch.fd);
+            files->watch.fd = -1;
+        }
+    }
+    reactor->files = files;
+    return files;
+}
+
+
+void files_destroy(struct file_cache *files) {
+    if (files == NULL) return;
+    for (unsigned i = 0; i < FILE_CACHE_BUCKETS; ++i) {
+        while (files->buckets[i]) file_uncache(files, files->buckets[i]);
+    }
+    if (files->watch.fd != -1) close(files->watch.fd);
+    close(files->root_fd);
+    free(files);
+}
+
+
+/* Only plain relative paths: no leading '/', no empty, "." or ".." segment. */
+static bool path_ok(const char *path, const size_t len) {
+    if (len == 0 || len >= PATH_MAX || memchr(path, '\0', len)) return false;
+    for (size_t start = 0; start <= len;) {
+        const char *slash = memchr(path + start, '/', len - start);
+        const size_t end = slash ? (size_t) (slash - path) : len;
+        const size_t seg = end - start;
+        if (seg == 0 || (path[start] == '.' && (seg == 1 || (seg == 2 && path[start + 1] == '.')))) return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+
+/* Opens name without leaving the root, following no symlink on the way.
+ * Kernels before openat2() get the same by walking one segment at a time.
+ */
+static int open_beneath(const int root_fd, const char *name) {
+    struct open_how how = { .flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS };
+    const int fd = (int) syscall(SYS_openat2, root_fd, name, &how, sizeof(how));
+    if (fd != -1 || errno != ENOSYS) return fd;
+
+    int dir_fd = root_fd;
+    for (const char *p = name;;) {
+        const char *slash = strchr(p, '/');
+        if (slash == NULL) {
+            const int file_fd = openat(dir_fd, p, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (dir_fd != root_fd) close(dir_fd);
+            return file_fd;
+        }
+        char segment[NAME_MAX + 1];
+        const size_t len = (size_t) (slash - p);
+        if (len > NAME_MAX) {
+            if (dir_fd != root_fd) close(dir_fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(segment, p, len);
+        segment[len] = '\0';
+        const int next = openat(dir_fd, segment, O_PATH | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (dir_fd != root_fd) close(dir_fd);
+        if (next == -1) return -1;
+        dir_fd = next;
+        p = slash + 1;
+    }
+}
+
+
+/* Hard links to a cached file get its watch back from inotify_add_watch(). */
+static bool watch_shared(const struct file_cache *files, const int wd) {
+    for (unsigned i = 0; i < FILE_CACHE_BUCKETS; ++i) {
+        for (const struct file *file = files->buckets[i]; file; file = file->next) {
+            if (file->wd == wd) return true;
+        }
+    }
+    return false;
+}
+
+
+/* Returns a referenced file, or NULL if there is no regular file at path. */
+static struct file *file_get(struct reactor *reactor, const char *path, const size_t len) {
+    struct file_cache *files = reactor_files(reactor);
+    char name[PATH_MAX];
+    struct stat st;
+
+    if (files == NULL || !path_ok(path, len)) return NULL;
+    const uint64_t hash = cache_hash(path, len);
+    for (struct file *file = files->buckets[hash % FILE_CACHE_BUCKETS]; file; file = file->next) {
+        if (file->hash == hash && strncmp(file->path, path, len) == 0 && file->path[len] == '\0') {
+            file->refs++;
+            return file;
+        }
+    }
+
+    memcpy(name, path, len);
+    name[len] = '\0';
+    struct file *file = calloc(1, sizeof(*file));
+    if (file == NULL) return NULL;
+    file->path = strdup(name);
+    file->hash = hash;
+    file->wd = -1;
+    file->refs = 1;
+
+    /* Watch before opening: a change after the open cannot be missed. */
+    if (files->watch.fd != -1 && files->count < FILE_CACHE_MAX) {
+        char full[PATH_MAX + 64];
+        snprintf(full, sizeof(full), "%s/%s", file_root, name);
+        file->wd = inotify_add_watch(files->watch.fd, full, WATCH_EVENTS);
+    }
+    file->fd = open_beneath(files->root_fd, name);
+    if (file->path == NULL || file->fd == -1 || fstat(file->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (file->fd != -1) close(file->fd);
+        if (file->wd != -1 && !watch_shared(files, file->wd)) inotify_rm_watch(files->watch.fd, file->wd);
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+    file->size = st.st_size;
+
+    if (file->wd != -1) {
+        file->cached = true;
+        file->refs++;
+        file->next = files->buckets[hash % FILE_CACHE_BUCKETS];
+        files->buckets[hash % FILE_CACHE_BUCKETS] = file;
+        files->count++;
+    }
+    return file;
+}
+
+
+static void transfer_start(struct conn *conn, struct transfer *t, struct file *file) {
+    t->file = file;
+    t->offset = 0;
+    t->end = file->size;
+    conn->sending = true;
+}
+
+
+/* Sends until the body is out or the socket is full. Returns -1 on error,
+ * including a file that shrank below the length already promised.
+ */
+static int transfer_pump(struct conn *conn, struct transfer *t) {
+    if (conn_flush(conn)) return -1;
+    if (conn->out_len) return 0;
+
+    while (t->piped || t->offset < t->end) {
+        ssize_t n;
+        if (t->pipe[0] == -1) {
+            n = sendfile(conn->watch.fd, t->file->fd, &t->offset, (size_t) (t->end - t->offset));
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                if (pipe2(t->pipe, O_NONBLOCK | O_CLOEXEC) == -1) return -1;
+                continue;
+            }
+        }
+        else {
+            if (t->piped == 0) {
+                n = splice(t->file->fd, &t->offset, t->pipe[1], NULL, (size_t) (t->end - t->offset),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n == 0) return -1;
+                if (n > 0) t->piped = (size_t) n;
+                else if (errno == EINTR) continue;
+                else return -1;
+            }
+            n = splice(t->pipe[0], NULL, conn->watch.fd, NULL, t->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) t->piped -= (size_t) n;
+        }
+        if (n > 0) {
+            stat_add(STAT_BYTES_OUT, (uint64_t) n);
+            continue;
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+
+    file_put(t->file);
+    t->file = NULL;
+    conn->sending = false;
+    return 0;
+}
+
+
+static void queue_head(struct conn *conn, const struct http_request *req, const char *status, const off_t length) {
+    size_t date_len;
+    const char *date = http_date(&date_len);
+    const char *connection = !req->keep_alive ? "Connection: close\r\n"
+                           : req->minor == 0 ? "Connection: keep-alive\r\n" : "";
+    char head[512];
+
+    const int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n" HTTP_SERVER_HEADER "%.*s"
+                             "Content-Type: application/octet-stream\r\nContent-Length: %lld\r\n%s\r\n", status,
+                             (int) date_len, date, (long long) length, connection);
+    conn_queue(conn, head, (size_t) len);
+}
+
+
+/* "GET /path HTTP/1.1" and headers. */
+static size_t handle_http(struct reactor *reactor, struct conn *conn, struct transfer *t, const char *buf,
+                          const size_t len, bool *last) {
+    struct http_request req;
+
+    const char *head_end = http_head_end(buf, buf + len);
+    if (head_end == NULL) {
+        if (len <= HTTP_MAX_HEAD) return 0;
+        http_error(conn, 431);
+        *last = true;
+        return len;
+    }
+    const int status = http_parse_head(buf, head_end + 2, &req);
+    const bool head_only = http_token_is(&req.method, "HEAD");
+    if (status || !(head_only || http_token_is(&req.method, "GET"))) {
+        http_error(conn, status ? status : 405);
+        *last = true;
+        return len;
+    }
+    const size_t used = (size_t) (head_end + 4 - buf) + req.content_length;
+    if (len < used) return 0;
+    *last = !req.keep_alive;
+
+    char path[PATH_MAX];
+    size_t path_len = req.target.len;
+    const char *query = memchr(req.target.data, '?', path_len);
+    if (query) path_len = (size_t) (query - req.target.data);
+    if (req.target.data[0] != '/' || path_len >= sizeof(path) - sizeof(INDEX_FILE)) path_len = 0;
+    else {
+        memcpy(path, req.target.data + 1, path_len - 1);
+        path_len--;
+        /* A directory means its index file. */
+        if (path_len == 0 || path[path_len - 1] == '/') {
+            memcpy(path + path_len, INDEX_FILE, sizeof(INDEX_FILE) - 1);
+            path_len += sizeof(INDEX_FILE) - 1;
+        }
+    }
+
+    struct file *file = file_get(reactor, path, path_len);
+    if (file == NULL) {
+        queue_head(conn, &req, "404 Not Found", 0);
+        return used;
+    }
+    queue_head(conn, &req, "200 OK", file->size);
+    if (head_only) file_put(file);
+    else transfer_start(conn, t, file);
+    return used;
+}
+
+
+/* A bare path: the raw file, then the connection closes, as nothing else
+ * marks where the file ends. A missing file just closes.
+ */
+static size_t handle_path_line(struct reactor *reactor, struct conn *conn, struct transfer *t, const char *buf,
+                               const size_t len, bool *last) {
+    const char *nl = memchr(buf, '\n', len);
+    if (nl == NULL) {
+        if (len < PATH_MAX) return 0;
+        *last = true;
+        return len;
+    }
+    const char *path = buf;
+    size_t path_len = (size_t) (nl > buf && nl[-1] == '\r' ? nl - 1 - buf : nl - buf);
+    if (path_len && path[0] == '/') {
+        path++;
+        path_len--;
+    }
+    struct file *file = file_get(reactor, path, path_len);
+    if (file) transfer_start(conn, t, file);
+    *last = true;
+    return len;
+}
+
+
+/* An HTTP request line ends in " HTTP/1.x"; anything else is a path. */
+static bool looks_like_http(const char *buf, const size_t len) {
+    const char *nl = memchr(buf, '\n', len);
+    if (nl == NULL) return len >= 4 && (memcmp(buf, "GET ", 4) == 0 || memcmp(buf, "HEAD", 4) == 0);
+    const char *end = nl > buf && nl[-1] == '\r' ? nl - 1 : nl;
+    return end - buf >= 9 && memcmp(end - 9, " HTTP/1.", 8) == 0;
+}
+
+
+/* Answers buffered requests until one starts a body that cannot go out at once. */
+static void file_serve(struct reactor *reactor, struct conn *conn) {
+    struct transfer *t = conn->session;
+    size_t used = 0;
+    bool last = false;
+
+    http_clock_update();
+    while (!last && t->file == NULL && used < conn->in_len) {
+        const char *buf = conn->in + used;
+        const size_t len = conn->in_len - used;
+        const size_t n = looks_like_http(buf, len) ? handle_http(reactor, conn, t, buf, len, &last)
+                                                   : handle_path_line(reactor, conn, t, buf, len, &last);
+        if (n == 0) break;
+        used += n;
+        if (t->file && transfer_pump(conn, t)) {
+            perror("transfer");
+            conn_close(reactor, conn);
+            return;
+        }
+    }
+    if (last) {
+        /* Whatever else arrives is ignored; close once the response is out. */
+        conn->eof = true;
+        used = conn->in_len;
+    }
+    conn_consume(conn, used);
+
+    if (conn_flush(conn)) {
+        perror("conn_flush");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+static int file_open(struct reactor *reactor, struct conn *conn) {
+    struct transfer *t = calloc(1, sizeof(*t));
+    if (t == NULL) return -1;
+    t->pipe[0] = t->pipe[1] = -1;
+    conn->session = t;
+    return 0;
+}
+
+
+static void file_readable(struct reactor *reactor, struct conn *conn) {
+    if (conn_fill(conn)) {
+        perror("read");
+        conn_close(reactor, conn);
+        return;
+    }
+    file_serve(reactor, conn);
+}
+
+
+/* Continues the body, then any requests that queued up behind it. */
+static void file_writable(struct reactor *reactor, struct conn *conn) {
+    struct transfer *t = conn->session;
+
+    if (t->file == NULL) return;
+    if (transfer_pump(conn, t)) {
+        perror("transfer");
+        conn_close(reactor, conn);
+        return;
+    }
+    if (t->file == NULL) file_serve(reactor, conn);
+}
+
+
+static void file_close(struct reactor *reactor, struct conn *conn) {
+    struct transfer *t = conn->session;
+    if (t == NULL) return;
+
+    if (t->file) file_put(t->file);
+    if (t->pipe[0] != -1) {
+        close(t->pipe[0]);
+        close(t->pipe[1]);
+    }
+    free(t);
+    conn->session = NULL;
+    conn->sending = false;
+}
+
+
+const struct protocol file_protocol = {
+    .name = "file",
+    .on_open = file_open,
+    .on_readable = file_readable,
+    .on_writable = file_writable,
+    .on_close = file_close,
+};
@@ -0,0 +1,86 @@
+# file_test.py
+# https://github.com/WhiteMonsterZeroUltraEnergy
+# MIT License
+#
+# Checks that file mode (-m file) serves nothing outside its root.
+# Usage: python3 file_test.py ./server
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = 3490
+
+try:
+    SERVER = sys.argv[1]
+except IndexError:
+    print("Usage: python3 file_test.py SERVER")
+    exit(1)
+
+
+def ask(request):
+    with socket.create_connection(("127.0.0.1", PORT)) as sock:
+        sock.sendall(request)
+        sock.shutdown(socket.SHUT_WR)
+        reply = b""
+        while chunk := sock.recv(65536):
+            reply += chunk
+        return reply
+
+
+with tempfile.TemporaryDirectory() as root, tempfile.TemporaryDirectory() as outside:
+    with open(os.path.join(root, "index.html"), "w") as f:
+        f.write("inside\n")
+    os.mkdir(os.path.join(root, "sub"))
+    with open(os.path.join(root, "sub", "page"), "w") as f:
+        f.write("nested\n")
+    with open(os.path.join(outside, "secret"), "w") as f:
+        f.write("outside\n")
+    os.symlink(os.path.join(outside, "secret"), os.path.join(root, "link"))
+    os.symlink(outside, os.path.join(root, "dir"))
+
+    server = subprocess.Popen([SERVER, "-m", "file", "-r", root], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(50):
+            try:
+                socket.create_connection(("127.0.0.1", PORT)).close()
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.1)
+
+        failed = 0
+        cases = [
+            (b"GET / HTTP/1.1\r\n\r\n", b"inside"),
+            (b"index.html\n", b"inside"),
+            (b"GET /sub/page HTTP/1.1\r\n\r\n", b"nested"),
+        ]
+        escapes = [
+            b"GET //etc/passwd HTTP/1.1\r\n\r\n",
+            b"GET //etc/hostname HTTP/1.1\r\n\r\n",
+            b"GET /../etc/passwd HTTP/1.1\r\n\r\n",
+            b"GET /./../etc/passwd HTTP/1.1\r\n\r\n",
+            b"GET /link HTTP/1.1\r\n\r\n",
+            b"GET /dir/secret HTTP/1.1\r\n\r\n",
+            b"//etc/passwd\n",
+            b"/../etc/passwd\n",
+            b"link\n",
+            b"dir/secret\n",
+        ]
+        for request, expect in cases:
+            if expect not in ask(request):
+                print(f"[!] {request!r}: not served", file=sys.stderr)
+                failed += 1
+        for request in escapes:
+            reply = ask(request)
+            if reply and not reply.startswith(b"HTTP/1.1 404"):
+                print(f"[!] {request!r}: escaped the root: {reply[:64]!r}", file=sys.stderr)
+                failed += 1
+    finally:
+        server.terminate()
+        server.wait()
+
+print(f"[*] {len(cases) + len(escapes) - failed} passed, {failed} failed.", file=sys.stderr)
+exit(1 if failed else 0)
@@ -0,0 +1,268 @@
+/**
+ * @file http.c
+ *
+ * @brief Minimal HTTP/1.1 mode for benchmarking the event loop with standard load tools.
+ *
+ * Requests are parsed where they lie in the receive buffer, without
+ * allocating: the end of the header block is found with an SSE2 scan for
+ * "\r\n\r\n", and only the request line, Content-Length, Connection and
+ * Transfer-Encoding are looked at. A request with a body gets it echoed back,
+ * any other request a fixed body. Connections are kept alive by default and
+ * pipelined requests are answered in one write per read.
+ *
+ * Every thread keeps its Date header, and the whole fixed response, ready to
+ * copy; both are rebuilt when the second changes. The parser, the Date
+ * header and error responses are shared with the file mode via http.h.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "http.h"
+#include "server.h"
+
+#define MAX_BODY (16 * 1024 * 1024)
+#define FIXED_BODY "Hello, World!\n"
+#define STATIC_HEADERS HTTP_SERVER_HEADER "Content-Type: text/plain\r\n"
+
+/* Rebuilt at most once a second by the thread that uses it. */
+struct http_clock {
+    time_t second;
+    char date[48];              /* "Date: ...\r\n" */
+    size_t date_len;
+    char fixed[256];            /* complete keep-alive response with the fixed body */
+    size_t fixed_len;
+};
+
+static _Thread_local struct http_clock http_clock;
+
+
+void http_clock_update(void) {
+    const time_t now = time(NULL);
+    struct tm tm;
+
+    if (now == http_clock.second) return;
+    http_clock.second = now;
+    gmtime_r(&now, &tm);
+    http_clock.date_len = strftime(http_clock.date, sizeof(http_clock.date), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    http_clock.fixed_len = (size_t) snprintf(http_clock.fixed, sizeof(http_clock.fixed),
+                                             "HTTP/1.1 200 OK\r\n" STATIC_HEADERS "%sContent-Length: %zu\r\n\r\n"
+                                             FIXED_BODY, http_clock.date, sizeof(FIXED_BODY) - 1);
+}
+
+
+const char *http_date(size_t *len) {
+    *len = http_clock.date_len;
+    return http_clock.date;
+}
+
+
+/* SSE2 finds the '\r's sixteen bytes at a time; only those are compared in full. */
+const char *http_head_end(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (end - p >= 16 + 3) {
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), cr));
+        for (; mask; mask &= mask - 1) {
+            const char *candidate = p + __builtin_ctz(mask);
+            if (memcmp(candidate, "\r\n\r\n", 4) == 0) return candidate;
+        }
+        p += 16;
+    }
+#endif
+    for (; end - p >= 4; ++p) {
+        if (p[0] == '\r' && memcmp(p, "\r\n\r\n", 4) == 0) return p;
+    }
+    return NULL;
+}
+
+
+bool http_token_is(const struct http_token *token, const char *word) {
+    return token->len == strlen(word) && strncasecmp(token->data, word, token->len) == 0;
+}
+
+
+/* Whether a comma-separated header value lists `word`. */
+static bool value_lists(struct http_token value, const char *word) {
+    const size_t len = strlen(word);
+    for (size_t i = 0; i + len <= value.len; ++i) {
+        if (strncasecmp(value.data + i, word, len) == 0) return true;
+    }
+    return false;
+}
+
+
+int http_parse_head(const char *buf, const char *end, struct http_request *req) {
+    const char *p = buf;
+    bool close = false, keep_alive = false;
+
+    const char *sp = memchr(p, ' ', (size_t) (end - p));
+    if (sp == NULL || sp == p) return 400;
+    req->method = (struct http_token) { p, (size_t) (sp - p) };
+    p = sp + 1;
+    sp = memchr(p, ' ', (size_t) (end - p));
+    if (sp == NULL || sp == p) return 400;
+    req->target = (struct http_token) { p, (size_t) (sp - p) };
+    p = sp + 1;
+    if (end - p < 10 || memcmp(p, "HTTP/1.", 7) != 0 || p[8] != '\r' || p[9] != '\n') return 400;
+    if (p[7] != '0' && p[7] != '1') return 505;
+    req->minor = (unsigned) (p[7] - '0');
+    p += 10;
+
+    req->content_length = 0;
+    while (p < end) {
+        const char *eol = memchr(p, '\r', (size_t) (end - p));
+        const char *colon = memchr(p, ':', (size_t) (eol - p));
+        if (colon == NULL || colon == p) return 400;
+        const struct http_token name = { p, (size_t) (colon - p) };
+        struct http_token value = { colon + 1, (size_t) (eol - colon - 1) };
+        while (value.len && (value.data[0] == ' ' || value.data[0] == '\t')) {
+            value.data++;
+            value.len--;
+        }
+        while (value.len && (value.data[value.len - 1] == ' ' || value.data[value.len - 1] == '\t')) value.len--;
+
+        if (http_token_is(&name, "Content-Length")) {
+            size_t length = 0;
+            if (value.len == 0) return 400;
+            for (size_t i = 0; i < value.len; ++i) {
+                if (value.data[i] < '0' || value.data[i] > '9') return 400;
+                length = length * 10 + (size_t) (value.data[i] - '0');
+                if (length > MAX_BODY) return 413;
+            }
+            req->content_length = length;
+        }
+        else if (http_token_is(&name, "Connection")) {
+            close |= value_lists(value, "close");
+            keep_alive |= value_lists(value, "keep-alive");
+        }
+        else if (http_token_is(&name, "Transfer-Encoding")) {
+            return 501;
+        }
+        p = eol + 2;
+    }
+    req->keep_alive = req->minor == 1 ? !close : keep_alive;
+    return 0;
+}
+
+
+static const char *reason(const int status) {
+    switch (status) {
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Content Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 501: return "Not Implemented";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Error";
+    }
+}
+
+
+void http_error(struct conn *conn, const int status) {
+    char head[256];
+    const int len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n" STATIC_HEADERS "%.*sContent-Length: 0\r\n"
+                             "Connection: close\r\n\r\n", status, reason(status), (int) http_clock.date_len,
+                             http_clock.date);
+    conn_queue(conn, head, (size_t) len);
+}
+
+
+static void respond(struct conn *conn, const struct http_request *req, const char *body) {
+    const bool head_only = http_token_is(&req->method, "HEAD");
+
+    /* The common case is one copy of a ready-made response. */
+    if (req->content_length == 0 && req->keep_alive && req->minor == 1) {
+        conn_queue(conn, http_clock.fixed, head_only ? http_clock.fixed_len - (sizeof(FIXED_BODY) - 1)
+                                                     : http_clock.fixed_len);
+        return;
+    }
+
+    const char *content = req->content_length ? body : FIXED_BODY;
+    const size_t content_len = req->content_length ? req->content_length : sizeof(FIXED_BODY) - 1;
+    const char *connection = !req->keep_alive ? "Connection: close\r\n"
+                           : req->minor == 0 ? "Connection: keep-alive\r\n" : "";
+    char head[256];
+    const int len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n" STATIC_HEADERS "%.*sContent-Length: %zu\r\n"
+                             "%s\r\n", (int) http_clock.date_len, http_clock.date, content_len, connection);
+    conn_queue(conn, head, (size_t) len);
+    if (!head_only) conn_queue(conn, content, content_len);
+}
+
+
+/* Answers the request at the start of buf. Returns the bytes it took, or 0
+ * if it is not all there yet. *last is set when the connection ends after it.
+ */
+static size_t handle_request(struct conn *conn, const char *buf, const size_t len, bool *last) {
+    struct http_request req;
+
+    const char *head_end = http_head_end(buf, buf + len);
+    if (head_end == NULL) {
+        if (len <= HTTP_MAX_HEAD) return 0;
+        http_error(conn, 431);
+        *last = true;
+        return len;
+    }
+    const int status = http_parse_head(buf, head_end + 2, &req);
+    if (status) {
+        http_error(conn, status);
+        *last = true;
+        return len;
+    }
+
+    const size_t head_len = (size_t) (head_end + 4 - buf);
+    if (len - head_len < req.content_length) return 0;
+    respond(conn, &req, buf + head_len);
+    *last = !req.keep_alive;
+    return head_len + req.content_length;
+}
+
+
+static void http_readable(struct reactor *reactor, struct conn *conn) {
+    size_t used = 0;
+    bool last = false;
+
+    if (conn_fill(conn)) {
+        perror("read");
+        conn_close(reactor, conn);
+        return;
+    }
+
+    http_clock_update();
+    while (!last && used < conn->in_len) {
+        const size_t n = handle_request(conn, conn->in + used, conn->in_len - used, &last);
+        if (n == 0) break;
+        used += n;
+    }
+    if (last) {
+        /* Whatever else arrives is ignored; close once the response is out. */
+        conn->eof = true;
+        used = conn->in_len;
+    }
+    conn_consume(conn, used);
+
+    if (conn_flush(conn)) {
+        perror("conn_flush");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+const struct protocol http_protocol = {
+    .name = "http",
+    .on_readable = http_readable,
+};
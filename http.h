@@ -0,0 +1,59 @@
+/**
+ * @file http.h
+ *
+ * @brief HTTP/1.x request parsing and response pieces shared by the HTTP and file modes.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HTTP_MAX_HEAD 8192
+#define HTTP_SERVER_HEADER "Server: simple-c-socket-epoll\r\n"
+
+struct conn;
+
+/* A slice of the receive buffer. */
+struct http_token {
+    const char *data;
+    size_t len;
+};
+
+struct http_request {
+    struct http_token method;
+    struct http_token target;
+    unsigned minor;             /* HTTP/1.<minor> */
+    size_t content_length;
+    bool keep_alive;
+};
+
+/* Start of the first "\r\n\r\n" in [p, end), or NULL. */
+const char *http_head_end(const char *p, const char *end);
+
+/* Parses the request line and headers in [buf, end), which ends with the
+ * last header's CRLF. Returns 0, or the status code to refuse it with.
+ */
+int http_parse_head(const char *buf, const char *end, struct http_request *req);
+
+/* Case-insensitive. */
+bool http_token_is(const struct http_token *token, const char *word);
+
+/* Refreshes this thread's cached Date header if the second has changed. */
+void http_clock_update(void);
+
+/* "Date: ...\r\n" as of the last http_clock_update(). */
+const char *http_date(size_t *len);
+
+/* Queues an empty error response with Connection: close; what follows the
+ * request cannot be trusted, so the caller ends the connection.
+ */
+void http_error(struct conn *conn, int status);
+
+#endif /* HTTP_H */
@@ -0,0 +1,336 @@
+/**
+ * @file journal.c
+ *
+ * @brief Append-only journal in preallocated segment files, with group commit.
+ *
+ * The journal is a directory of segments, journal.000001 upwards. Each is
+ * allocated at its full size when it is created, so appending never grows
+ * the file and an fdatasync() has only the data to flush, not the size. A
+ * record is a header with its length, its sequence number and a checksum,
+ * followed by its bytes; a record never spans two segments.
+ *
+ * Appending only copies the record into a shared buffer. A commit swaps
+ * that buffer for an empty one, writes it with as few pwrite() calls as the
+ * segments allow and syncs once. Threads that queued records while a sync
+ * was running wait for the commit lock and usually find that the next
+ * commit, by whoever gets there first, took theirs along.
+ *
+ * On opening, the segments are read in order and every record replayed
+ * until the first one that is missing, torn or out of sequence; the rest of
+ * the last segment is cleared, so nothing stale can be taken for a record
+ * later. A bad record in any segment but the last is corruption, not a
+ * crash, and the journal refuses to open.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "journal.h"
+
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+#define ZERO_CHUNK (1024 * 1024)
+
+struct record_header {
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t seq;                   /* from 1; an all-zero header is unwritten space */
+    uint64_t check;
+};
+
+/* Records back to back, headers included. */
+struct batch {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct batch queued;
+static uint64_t queued_seq;         /* last sequence number handed out */
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct batch writing;
+static atomic_uint_fast64_t durable_seq;
+static bool failed;                 /* a write or sync failed: stop pretending */
+static int dir_fd = -1;
+static int segment_fd = -1;
+static unsigned segment_index;
+static off_t segment_offset;
+static off_t segment_size;
+
+
+static uint64_t record_check(const char *data, const size_t len, const uint64_t seq) {
+    return cache_hash(data, len) ^ (seq * 0x9e3779b97f4a7c15ULL);
+}
+
+
+static void segment_name(char *name, const size_t size, const unsigned index) {
+    snprintf(name, size, "journal.%06u", index);
+}
+
+
+/* Opens a new segment with all of its blocks allocated and makes its
+ * directory entry durable.
+ */
+static int segment_create(const unsigned index, const off_t size) {
+    char name[32];
+
+    segment_name(name, sizeof(name), index);
+    const int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    /* Where fallocate() is missing, a sparse file still reads as zeros. */
+    if ((fallocate(fd, 0, 0, size) && ftruncate(fd, size)) || fsync(fd) || fsync(dir_fd)) {
+        close(fd);
+        return -1;
+    }
+    segment_fd = fd;
+    segment_index = index;
+    segment_offset = 0;
+    segment_size = size;
+    return 0;
+}
+
+
+/* Seals the current segment and starts the next, big enough for at least
+ * one record of record_len bytes.
+ */
+static int segment_next(const size_t record_len) {
+    if (fdatasync(segment_fd)) return -1;
+    close(segment_fd);
+    segment_fd = -1;
+    const off_t size = record_len > JOURNAL_SEGMENT_SIZE ? (off_t) record_len : JOURNAL_SEGMENT_SIZE;
+    return segment_create(segment_index + 1, size);
+}
+
+
+static int write_all(const char *data, size_t len) {
+    while (len) {
+        const ssize_t n = pwrite(segment_fd, data, len, segment_offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t) n;
+        segment_offset += n;
+    }
+    return 0;
+}
+
+
+/* Writes the batch, one pwrite() per segment it lands in. */
+static int batch_write(const struct batch *batch) {
+    size_t start = 0;
+    size_t end = 0;
+
+    while (end < batch->len) {
+        struct record_header header;
+        memcpy(&header, batch->data + end, sizeof(header));
+        const size_t record_len = sizeof(header) + header.len;
+        if (segment_offset + (off_t) (end - start + record_len) > segment_size) {
+            if (write_all(batch->data + start, end - start) || segment_next(record_len)) return -1;
+            start = end;
+        }
+        end += record_len;
+    }
+    return write_all(batch->data + start, end - start);
+}
+
+
+static int batch_reserve(struct batch *batch, const size_t more) {
+    if (batch->len + more <= batch->size) return 0;
+
+    size_t size = batch->size ? batch->size : 64 * 1024;
+    while (size < batch->len + more) size *= 2;
+    char *data = realloc(batch->data, size);
+    if (data == NULL) return -1;
+    batch->data = data;
+    batch->size = size;
+    return 0;
+}
+
+
+/* Replays the segment's records from the start. Returns where they end;
+ * *torn is set if something other than unwritten space follows them.
+ */
+static off_t segment_replay(const char *map, const off_t size, uint64_t *seq, const journal_replay replay,
+                            bool *torn) {
+    static const struct record_header unwritten;
+    off_t offset = 0;
+
+    *torn = false;
+    while (offset + (off_t) sizeof(struct record_header) <= size) {
+        struct record_header header;
+        memcpy(&header, map + offset, sizeof(header));
+        if (memcmp(&header, &unwritten, sizeof(header)) == 0) return offset;
+
+        const char *data = map + offset + sizeof(header);
+        if (header.seq != *seq + 1 || header.len > size - offset - (off_t) sizeof(header)
+            || header.check != record_check(data, header.len, header.seq)) {
+            *torn = true;
+            return offset;
+        }
+        replay(data, header.len);
+        *seq = header.seq;
+        offset += (off_t) (sizeof(header) + header.len);
+    }
+    return offset;
+}
+
+
+/* Clears the last segment from offset on, if anything is left there. */
+static int segment_clear_tail(const int fd, const char *map, const off_t offset, const off_t size) {
+    off_t dirty = offset;
+    while (dirty < size && map[dirty] == 0) dirty++;
+    if (dirty == size) return 0;
+
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, size - offset) == 0) return fdatasync(fd);
+
+    /* No ZERO_RANGE here: write the zeros. */
+    char *zeros = calloc(1, ZERO_CHUNK);
+    if (zeros == NULL) return -1;
+    for (off_t at = offset; at < size;) {
+        const size_t len = size - at < ZERO_CHUNK ? (size_t) (size - at) : ZERO_CHUNK;
+        const ssize_t n = pwrite(fd, zeros, len, at);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            free(zeros);
+            return -1;
+        }
+        at += n;
+    }
+    free(zeros);
+    return fdatasync(fd);
+}
+
+
+int journal_open(const char *dir, const journal_replay replay) {
+    unsigned last = 0;
+    uint64_t seq = 0;
+    char name[32];
+
+    if (mkdir(dir, 0755) && errno != EEXIST) return -1;
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) return -1;
+
+    for (;; ++last) {
+        segment_name(name, sizeof(name), last + 1);
+        if (faccessat(dir_fd, name, F_OK, 0)) break;
+    }
+    for (unsigned index = 1; index <= last; ++index) {
+        struct stat st;
+        bool torn;
+
+        segment_name(name, sizeof(name), index);
+        const int fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st)) {
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        const char *map = st.st_size ? mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        const off_t end = segment_replay(map, st.st_size, &seq, replay, &torn);
+        if (index < last) {
+            if (map) munmap((void *) map, (size_t) st.st_size);
+            close(fd);
+            if (torn) {
+                fprintf(stderr, "[!] Journal segment %s is corrupt at offset %lld.\n", name, (long long) end);
+                errno = EILSEQ;
+                return -1;
+            }
+            continue;
+        }
+
+        /* The last segment: appending resumes where its records end. */
+        const int rc = map ? segment_clear_tail(fd, map, end, st.st_size) : 0;
+        if (map) munmap((void *) map, (size_t) st.st_size);
+        if (rc) {
+            close(fd);
+            return -1;
+        }
+        if (torn) fprintf(stderr, "[!] Journal: dropped a torn record at the end of %s.\n", name);
+        segment_fd = fd;
+        segment_index = index;
+        segment_offset = end;
+        segment_size = st.st_size;
+    }
+    if (segment_fd == -1 && segment_create(last + 1, JOURNAL_SEGMENT_SIZE)) return -1;
+
+    queued_seq = seq;
+    atomic_init(&durable_seq, seq);
+    fprintf(stderr, "[*] Journal: replayed %llu records from %u segments.\n", (unsigned long long) seq, last);
+    return 0;
+}
+
+
+uint64_t journal_append(const void *record, const size_t len) {
+    if (len > UINT32_MAX) return 0;
+
+    pthread_mutex_lock(&queue_lock);
+    if (batch_reserve(&queued, sizeof(struct record_header) + len)) {
+        pthread_mutex_unlock(&queue_lock);
+        return 0;
+    }
+    const uint64_t seq = ++queued_seq;
+    const struct record_header header = { (uint32_t) len, 0, seq, record_check(record, len, seq) };
+    memcpy(queued.data + queued.len, &header, sizeof(header));
+    memcpy(queued.data + queued.len + sizeof(header), record, len);
+    queued.len += sizeof(header) + len;
+    pthread_mutex_unlock(&queue_lock);
+    return seq;
+}
+
+
+int journal_commit(const uint64_t seq) {
+    if (atomic_load_explicit(&durable_seq, memory_order_acquire) >= seq) return 0;
+
+    pthread_mutex_lock(&commit_lock);
+    int rc = failed ? -1 : 0;
+    if (rc == 0 && atomic_load_explicit(&durable_seq, memory_order_relaxed) < seq) {
+        /* Take everything queued so far, not just up to seq. */
+        pthread_mutex_lock(&queue_lock);
+        const struct batch batch = queued;
+        queued = writing;
+        writing = batch;
+        const uint64_t last = queued_seq;
+        pthread_mutex_unlock(&queue_lock);
+
+        rc = batch_write(&writing) || fdatasync(segment_fd) ? -1 : 0;
+        writing.len = 0;
+        if (rc) failed = true;
+        else atomic_store_explicit(&durable_seq, last, memory_order_release);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return rc;
+}
+
+
+void journal_close(void) {
+    if (dir_fd == -1) return;
+    if (journal_commit(queued_seq)) perror("journal_commit");
+    if (segment_fd != -1) close(segment_fd);
+    close(dir_fd);
+    free(queued.data);
+    free(writing.data);
+    queued = writing = (struct batch) { 0 };
+    segment_fd = dir_fd = -1;
+}
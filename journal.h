@@ -0,0 +1,45 @@
+/**
+ * @file journal.h
+ *
+ * @brief Append-only journal in preallocated segment files, with group commit.
+ *
+ * Records queued by any thread go to disk together: whichever thread
+ * commits first writes everything queued so far and pays for one
+ * fdatasync(), and the others find their records already durable.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Receives a record while the journal is opened; copy what you keep. */
+typedef void (*journal_replay)(const char *record, size_t len);
+
+/* Opens the journal in dir, creating both if need be, and replays its
+ * records oldest first. A torn record at the end is dropped. Returns -1
+ * with errno set if the journal cannot be used.
+ */
+int journal_open(const char *dir, journal_replay replay);
+
+/* Queues a record. Records are replayed in the order they were queued;
+ * callers whose changes must replay in the order they were applied hold
+ * their own lock around both. Returns its sequence number, or 0 when out
+ * of memory.
+ */
+uint64_t journal_append(const void *record, size_t len);
+
+/* Returns once every record up to seq is on disk. Returns -1 if the journal
+ * could not be written: nothing after that can be trusted to be durable.
+ */
+int journal_commit(uint64_t seq);
+
+void journal_close(void);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,469 @@
+/**
+ * @file memcache.c
+ *
+ * @brief memcached text protocol mode: get, set and delete over sharded caches.
+ *
+ * Each reactor owns one cache shard, and a key belongs to the shard its hash
+ * picks. A command for a local key runs in place. One for another reactor's
+ * key is sent there as a message and its reply comes back the same way, so
+ * no shard is ever locked. A reply that is ready early waits in the
+ * connection's queue until every earlier reply is out, so a pipelining
+ * client sees them in order.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "server.h"
+
+#define MAX_LINE 2048
+#define RELATIVE_EXPIRY_MAX (60 * 60 * 24 * 30)
+
+size_t cache_limit = 64 * 1024 * 1024;
+
+enum op_type {
+    OP_GET,
+    OP_SET,
+    OP_DELETE,
+    OP_REPLY,                   /* fixed text, only waiting for its turn */
+};
+
+/* One command. Lives on the stack when it runs at once; copied to the heap
+ * when it has to travel to another shard or wait behind one that did.
+ */
+struct cache_op {
+    struct message msg;
+    struct cache_op *next;      /* the connection's reply order */
+    struct conn *conn;
+    unsigned origin;            /* reactor the reply goes back to */
+    enum op_type type;
+    bool noreply;
+    bool done;
+    uint64_t hash;
+    uint32_t flags;
+    uint32_t expires;
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+    const char *reply;
+    size_t reply_len;
+    char *buffer;               /* the reply of a hit, NULL otherwise */
+    char data[];                /* key, then value, once copied */
+};
+
+/* Replies not written yet, oldest first. The head is always still out at
+ * another reactor: anything behind it is written as soon as it returns.
+ */
+struct session {
+    struct cache_op *head;
+    struct cache_op *tail;
+};
+
+struct token {
+    const char *data;
+    size_t len;
+};
+
+
+static bool next_token(const char **p, const char *end, struct token *token) {
+    while (*p < end && **p == ' ') (*p)++;
+    if (*p == end) return false;
+    token->data = *p;
+    while (*p < end && **p != ' ') (*p)++;
+    token->len = (size_t) (*p - token->data);
+    return true;
+}
+
+
+static bool is(const struct token *token, const char *word) {
+    return token->len == strlen(word) && memcmp(token->data, word, token->len) == 0;
+}
+
+
+static bool parse_unsigned(const struct token *token, const uint64_t max, uint64_t *out) {
+    uint64_t value = 0;
+
+    if (token->len == 0 || token->len > 20) return false;
+    for (size_t i = 0; i < token->len; ++i) {
+        const char c = token->data[i];
+        if (c < '0' || c > '9') return false;
+        value = value * 10 + (uint64_t) (c - '0');
+        if (value > max) return false;
+    }
+    *out = value;
+    return true;
+}
+
+
+/* memcached's exptime: 0 never, up to 30 days relative, beyond that a unix
+ * time; negative means already expired.
+ */
+static bool parse_expiry(const struct token *token, uint32_t *expires) {
+    struct token digits = *token;
+    uint64_t value;
+
+    if (digits.len && digits.data[0] == '-') {
+        digits.data++;
+        digits.len--;
+        if (!parse_unsigned(&digits, UINT32_MAX, &value)) return false;
+        *expires = 1;
+        return true;
+    }
+    if (!parse_unsigned(&digits, UINT32_MAX, &value)) return false;
+    if (value == 0 || value > RELATIVE_EXPIRY_MAX) *expires = (uint32_t) value;
+    else *expires = (uint32_t) time(NULL) + (uint32_t) value;
+    return true;
+}
+
+
+/* Multiply-shift on the top half: the shard does not reuse the bits that pick
+ * the slot group and tag inside the shard.
+ */
+static unsigned shard_of(const uint64_t hash) {
+    return (unsigned) (((hash >> 32) * reactor_count) >> 32);
+}
+
+
+/* Created on first use by the thread that owns it. */
+static struct cache *reactor_cache(struct reactor *reactor) {
+    if (reactor->cache == NULL) reactor->cache = cache_create(cache_limit / reactor_count);
+    return reactor->cache;
+}
+
+
+/* Runs the command on its shard. A hit is returned, valid until the shard
+ * changes; any other outcome is left in op->reply.
+ */
+static const struct item *op_run(struct cache *cache, struct cache_op *op) {
+    const char *reply = NULL;
+
+    switch (op->type) {
+        case OP_GET:
+            return cache ? cache_get(cache, op->key, op->key_len, op->hash) : NULL;
+        case OP_SET:
+            if (cache && cache_set(cache, op->key, op->key_len, op->hash, op->value, op->value_len, op->flags,
+                                   op->expires) == 0) {
+                reply = "STORED\r\n";
+            }
+            else reply = "SERVER_ERROR out of memory storing object\r\n";
+            break;
+        case OP_DELETE:
+            reply = cache && cache_delete(cache, op->key, op->key_len, op->hash) ? "DELETED\r\n" : "NOT_FOUND\r\n";
+            break;
+        case OP_REPLY:
+            return NULL;
+    }
+    if (!op->noreply) {
+        op->reply = reply;
+        op->reply_len = strlen(reply);
+    }
+    return NULL;
+}
+
+
+static int value_header(char *header, const size_t size, const struct item *item) {
+    return snprintf(header, size, "VALUE %.*s %u %u\r\n", (int) item->key_len, item_key(item), item->flags,
+                    item->value_len);
+}
+
+
+/* Straight from slab memory into the output buffer. */
+static void queue_value(struct conn *conn, const struct item *item) {
+    char header[CACHE_MAX_KEY + 64];
+    const int len = value_header(header, sizeof(header), item);
+
+    conn_queue(conn, header, (size_t) len);
+    conn_queue(conn, item_value(item), item->value_len);
+    conn_queue(conn, "\r\n", 2);
+}
+
+
+/* Runs op on this thread's shard and keeps the reply in the op. */
+static void op_finish(struct cache *cache, struct cache_op *op) {
+    const struct item *item = op_run(cache, op);
+    if (item == NULL) return;
+
+    char header[CACHE_MAX_KEY + 64];
+    const size_t len = (size_t) value_header(header, sizeof(header), item);
+    op->buffer = malloc(len + item->value_len + 2);
+    if (op->buffer == NULL) {
+        op->reply = "SERVER_ERROR out of memory\r\n";
+        op->reply_len = strlen(op->reply);
+        return;
+    }
+    memcpy(op->buffer, header, len);
+    memcpy(op->buffer + len, item_value(item), item->value_len);
+    memcpy(op->buffer + len + item->value_len, "\r\n", 2);
+    op->reply = op->buffer;
+    op->reply_len = len + item->value_len + 2;
+}
+
+
+static void op_free(struct cache_op *op) {
+    free(op->buffer);
+    free(op);
+}
+
+
+static struct cache_op *op_copy(const struct cache_op *cmd) {
+    struct cache_op *op = malloc(sizeof(*op) + cmd->key_len + cmd->value_len);
+    if (op == NULL) return NULL;
+
+    *op = *cmd;
+    if (cmd->key_len) memcpy(op->data, cmd->key, cmd->key_len);
+    if (cmd->value_len) memcpy(op->data + cmd->key_len, cmd->value, cmd->value_len);
+    op->key = op->data;
+    op->value = op->data + cmd->key_len;
+    op->buffer = NULL;
+    op->done = false;
+    return op;
+}
+
+
+/* Writes every reply at the head of the queue that is ready. */
+static void session_drain(struct conn *conn) {
+    struct session *session = conn->session;
+
+    while (session->head && session->head->done) {
+        struct cache_op *op = session->head;
+        session->head = op->next;
+        if (op->reply_len) conn_queue(conn, op->reply, op->reply_len);
+        op_free(op);
+    }
+}
+
+
+/* Back at the connection's reactor with the reply. */
+static void op_complete(struct reactor *reactor, struct message *msg) {
+    struct cache_op *op = container_of(msg, struct cache_op, msg);
+    struct conn *conn = op->conn;
+
+    conn->inflight--;
+    if (conn->closed) {
+        op_free(op);
+        if (conn->inflight == 0) conn_release(reactor, conn);
+        return;
+    }
+    op->done = true;
+    session_drain(conn);
+    if (conn_flush(conn)) {
+        perror("conn_flush");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+/* At the reactor that owns the key. */
+static void op_execute(struct reactor *reactor, struct message *msg) {
+    struct cache_op *op = container_of(msg, struct cache_op, msg);
+
+    op_finish(reactor_cache(reactor), op);
+    op->msg.deliver = op_complete;
+    reactor_submit(reactor, op->origin, &op->msg);
+}
+
+
+/* Queues an op behind the replies still outstanding. */
+static int session_append(struct conn *conn, struct cache_op *op) {
+    struct session *session = conn->session;
+
+    if (session == NULL) {
+        session = calloc(1, sizeof(*session));
+        if (session == NULL) return -1;
+        conn->session = session;
+    }
+    op->next = NULL;
+    if (session->head) session->tail->next = op;
+    else session->head = op;
+    session->tail = op;
+    return 0;
+}
+
+
+static bool session_idle(const struct conn *conn) {
+    const struct session *session = conn->session;
+    return session == NULL || session->head == NULL;
+}
+
+
+/* Runs a command in place when its key is local and nothing is waiting;
+ * otherwise copies it and queues it, sending it to the owner if that is
+ * another reactor. Returns -1 when out of memory.
+ */
+static int dispatch_op(struct reactor *reactor, struct conn *conn, struct cache_op *cmd) {
+    const unsigned owner = cmd->type == OP_REPLY ? reactor->index : shard_of(cmd->hash);
+
+    if (owner == reactor->index && session_idle(conn)) {
+        const struct item *item = op_run(reactor_cache(reactor), cmd);
+        if (item) queue_value(conn, item);
+        else if (cmd->reply_len) conn_queue(conn, cmd->reply, cmd->reply_len);
+        return 0;
+    }
+
+    struct cache_op *op = op_copy(cmd);
+    if (op == NULL || session_append(conn, op) == -1) {
+        free(op);
+        return -1;
+    }
+    if (owner == reactor->index) {
+        op_finish(reactor_cache(reactor), op);
+        op->done = true;
+        return 0;
+    }
+    op->conn = conn;
+    op->origin = reactor->index;
+    op->msg.deliver = op_execute;
+    conn->inflight++;
+    reactor_submit(reactor, owner, &op->msg);
+    return 0;
+}
+
+
+static int reply(struct reactor *reactor, struct conn *conn, const char *text) {
+    struct cache_op cmd = { .type = OP_REPLY, .reply = text, .reply_len = strlen(text) };
+    return dispatch_op(reactor, conn, &cmd);
+}
+
+
+static int keyed(struct reactor *reactor, struct conn *conn, struct cache_op *cmd, const struct token *key) {
+    if (key->len > CACHE_MAX_KEY) return reply(reactor, conn, "CLIENT_ERROR bad command line format\r\n");
+    cmd->key = key->data;
+    cmd->key_len = key->len;
+    cmd->hash = cache_hash(key->data, key->len);
+    return dispatch_op(reactor, conn, cmd);
+}
+
+
+/* Handles the command at the start of buf. Returns the bytes it took, 0 if it
+ * is not all there yet, or -1 to stop reading the connection: quit, a broken
+ * stream or no memory.
+ */
+static ssize_t parse_command(struct reactor *reactor, struct conn *conn, const char *buf, const size_t len) {
+    struct cache_op cmd = { 0 };
+    struct token name, key, flags, exptime, bytes, extra;
+    uint64_t value;
+
+    const char *nl = memchr(buf, '\n', len);
+    if (nl == NULL) {
+        if (len <= MAX_LINE) return 0;
+        reply(reactor, conn, "CLIENT_ERROR line too long\r\n");
+        return -1;
+    }
+    const char *end = nl > buf && nl[-1] == '\r' ? nl - 1 : nl;
+    const char *p = buf;
+    const size_t used = (size_t) (nl + 1 - buf);
+
+    if (!next_token(&p, end, &name)) return reply(reactor, conn, "ERROR\r\n") ? -1 : (ssize_t) used;
+
+    if (is(&name, "get")) {
+        bool any = false;
+        cmd.type = OP_GET;
+        while (next_token(&p, end, &key)) {
+            any = true;
+            if (keyed(reactor, conn, &cmd, &key)) return -1;
+        }
+        return reply(reactor, conn, any ? "END\r\n" : "ERROR\r\n") ? -1 : (ssize_t) used;
+    }
+
+    if (is(&name, "set")) {
+        /* Without a valid length the data block cannot be skipped. */
+        if (!next_token(&p, end, &key) || !next_token(&p, end, &flags) || !next_token(&p, end, &exptime) ||
+            !next_token(&p, end, &bytes) || !parse_unsigned(&flags, UINT32_MAX, &value) ||
+            !parse_expiry(&exptime, &cmd.expires)) {
+            reply(reactor, conn, "CLIENT_ERROR bad command line format\r\n");
+            return -1;
+        }
+        cmd.flags = (uint32_t) value;
+        if (!parse_unsigned(&bytes, UINT32_MAX, &value)) {
+            reply(reactor, conn, "CLIENT_ERROR bad command line format\r\n");
+            return -1;
+        }
+        if (next_token(&p, end, &extra)) cmd.noreply = is(&extra, "noreply");
+
+        /* The data block follows the line; wait until all of it is here. */
+        if (len - used < value + 2) return 0;
+        const char *data = buf + used;
+        if (data[value] != '\r' || data[value + 1] != '\n') {
+            reply(reactor, conn, "CLIENT_ERROR bad data chunk\r\n");
+            return -1;
+        }
+        cmd.type = OP_SET;
+        cmd.value = data;
+        cmd.value_len = (size_t) value;
+        return keyed(reactor, conn, &cmd, &key) ? -1 : (ssize_t) (used + value + 2);
+    }
+
+    if (is(&name, "delete")) {
+        if (!next_token(&p, end, &key)) return reply(reactor, conn, "ERROR\r\n") ? -1 : (ssize_t) used;
+        if (next_token(&p, end, &extra)) cmd.noreply = is(&extra, "noreply");
+        cmd.type = OP_DELETE;
+        return keyed(reactor, conn, &cmd, &key) ? -1 : (ssize_t) used;
+    }
+
+    if (is(&name, "quit")) return -1;
+
+    return reply(reactor, conn, "ERROR\r\n") ? -1 : (ssize_t) used;
+}
+
+
+static void memcache_readable(struct reactor *reactor, struct conn *conn) {
+    size_t used = 0;
+
+    if (conn_fill(conn)) {
+        perror("read");
+        conn_close(reactor, conn);
+        return;
+    }
+
+    while (used < conn->in_len) {
+        const ssize_t n = parse_command(reactor, conn, conn->in + used, conn->in_len - used);
+        if (n == 0) break;
+        if (n < 0) {
+            conn->eof = true;
+            used = conn->in_len;
+            break;
+        }
+        used += (size_t) n;
+    }
+    conn_consume(conn, used);
+
+    if (conn_flush(conn)) {
+        perror("conn_flush");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+/* Ops still out at other reactors free themselves when they come back. */
+static void memcache_close(struct reactor *reactor, struct conn *conn) {
+    struct session *session = conn->session;
+    if (session == NULL) return;
+
+    for (struct cache_op *op = session->head, *next; op; op = next) {
+        next = op->next;
+        if (op->done) op_free(op);
+    }
+    free(session);
+    conn->session = NULL;
+}
+
+
+const struct protocol memcache_protocol = {
+    .name = "memcache",
+    .on_readable = memcache_readable,
+    .on_close = memcache_close,
+};
@@ -0,0 +1,230 @@
+/**
+ * @file pool.c
+ *
+ * @brief Work-stealing thread pool for running handlers off the I/O reactor.
+ *
+ * Every worker owns a deque. Submitted tasks are spread round-robin over the
+ * deques; a worker takes the oldest task from its own deque and, when that is
+ * empty, steals the newest task from another worker before going to sleep.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define DEQUE_INITIAL_SIZE 64
+
+
+struct deque {
+    pthread_mutex_t lock;
+    struct task **slots;
+    size_t head;
+    size_t count;
+    size_t size;
+};
+
+struct worker {
+    struct pool *pool;
+    pthread_t thread;
+    unsigned index;
+    struct deque deque;
+};
+
+struct pool {
+    struct worker *workers;
+    unsigned count;
+    atomic_uint cursor;     /* round-robin submit position */
+    atomic_long queued;     /* tasks sitting in any deque */
+    atomic_int idle;        /* workers asleep on `wake` */
+    atomic_bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+
+static int deque_init(struct deque *dq) {
+    dq->slots = malloc(DEQUE_INITIAL_SIZE * sizeof(*dq->slots));
+    if (dq->slots == NULL) return -1;
+    dq->head = 0;
+    dq->count = 0;
+    dq->size = DEQUE_INITIAL_SIZE;
+    pthread_mutex_init(&dq->lock, NULL);
+    return 0;
+}
+
+
+/* Doubles the ring, unwrapping it so head starts at 0 again. */
+static int deque_grow(struct deque *dq) {
+    struct task **slots = malloc(2 * dq->size * sizeof(*slots));
+    if (slots == NULL) return -1;
+    for (size_t i = 0; i < dq->count; ++i) {
+        slots[i] = dq->slots[(dq->head + i) % dq->size];
+    }
+    free(dq->slots);
+    dq->slots = slots;
+    dq->head = 0;
+    dq->size *= 2;
+    return 0;
+}
+
+
+static int deque_push(struct deque *dq, struct task *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->size && deque_grow(dq) == -1) {
+        pthread_mutex_unlock(&dq->lock);
+        return -1;
+    }
+    dq->slots[(dq->head + dq->count) % dq->size] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+
+/* Owner side: oldest task first, so a busy worker stays fair to its queue. */
+static struct task *deque_take(struct deque *dq) {
+    struct task *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count) {
+        task = dq->slots[dq->head];
+        dq->head = (dq->head + 1) % dq->size;
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+
+/* Thief side: newest task, the one the owner would reach last. */
+static struct task *deque_steal(struct deque *dq) {
+    struct task *task = NULL;
+    if (pthread_mutex_trylock(&dq->lock) != 0) return NULL;
+    if (dq->count) {
+        dq->count--;
+        task = dq->slots[(dq->head + dq->count) % dq->size];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+
+static struct task *find_task(struct worker *self) {
+    struct pool *pool = self->pool;
+
+    struct task *task = deque_take(&self->deque);
+    for (unsigned i = 1; task == NULL && i < pool->count; ++i) {
+        task = deque_steal(&pool->workers[(self->index + i) % pool->count].deque);
+    }
+    if (task) atomic_fetch_sub(&pool->queued, 1);
+    return task;
+}
+
+
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    struct pool *pool = self->pool;
+
+    while (true) {
+        struct task *task = find_task(self);
+        if (task) {
+            task->run(task);
+            mailbox_post(task->reply, &task->node);
+            continue;
+        }
+
+        /* queued is re-checked after announcing ourselves idle, pool_submit()
+         * checks idle after bumping queued, so one of us always sees the other. */
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->idle, 1);
+        while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->running)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!atomic_load(&pool->running) && atomic_load(&pool->queued) == 0) break;
+    }
+    return NULL;
+}
+
+
+struct pool *pool_create(const unsigned workers) {
+    struct pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) return NULL;
+
+    pool->workers = calloc(workers, sizeof(*pool->workers));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    atomic_init(&pool->running, true);
+
+    for (unsigned i = 0; i < workers; ++i) {
+        struct worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        if (deque_init(&w->deque) == -1) break;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            free(w->deque.slots);
+            break;
+        }
+        pool->count++;
+    }
+    if (pool->count != workers) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+
+void pool_submit(struct pool *pool, struct task *task) {
+    unsigned start = atomic_fetch_add_explicit(&pool->cursor, 1, memory_order_relaxed);
+
+    /* A deque only refuses when it cannot grow; try the others before giving up. */
+    for (unsigned i = 0; i < pool->count; ++i) {
+        if (deque_push(&pool->workers[(start + i) % pool->count].deque, task) == 0) {
+            atomic_fetch_add(&pool->queued, 1);
+            if (atomic_load(&pool->idle) > 0) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_signal(&pool->wake);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return;
+        }
+    }
+
+    /* Out of memory: do the work here rather than lose the request. */
+    task->run(task);
+    mailbox_post(task->reply, &task->node);
+}
+
+
+void pool_destroy(struct pool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->running, false);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->count; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.slots);
+    }
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,38 @@
+/**
+ * @file pool.h
+ *
+ * @brief Work-stealing thread pool for running handlers off the I/O reactor.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "queue.h"
+
+/* A unit of work. Embed it in the request structure and recover the request
+ * with container_of() inside run(). Once run() returns, the task is posted to
+ * its reply mailbox, so the reactor that submitted it gets it back.
+ */
+struct task {
+    struct mpsc_node node;
+    void (*run)(struct task *task);
+    struct mailbox *reply;
+};
+
+struct pool;
+
+/* Starts `workers` threads. Returns NULL on failure. */
+struct pool *pool_create(unsigned workers);
+
+/* Queues a task on one of the workers; idle workers steal from busy ones. */
+void pool_submit(struct pool *pool, struct task *task);
+
+/* Runs whatever is still queued, then stops and frees the pool. */
+void pool_destroy(struct pool *pool);
+
+#endif /* POOL_H */
@@ -0,0 +1,613 @@
+/**
+ * @file proxy.c
+ *
+ * @brief TCP forwarding mode: relays every connection to a pool of backends.
+ *
+ * Each accepted connection is paired with a non-blocking connection to one
+ * backend in the same reactor. Both directions are moved with splice()
+ * through a pipe of their own, so the payload never reaches user space. A
+ * direction stops reading while its pipe is full, which leaves the
+ * backpressure to the sender's TCP window. A FIN is passed on with
+ * shutdown() once everything before it has been delivered, and the pair
+ * closes when both directions are done.
+ *
+ * The backend is picked round-robin, by fewest active relays, or from a
+ * consistent-hash ring over the client's address, so a client keeps its
+ * backend while the pool stays the same. Reactor 0 probes every backend
+ * once a tick with a connect(); a backend that fails a probe or a real
+ * connect is skipped until a probe succeeds again, and a client whose
+ * connect failed is retried on another one. While every backend is down,
+ * clients are turned away. With -W each reactor keeps
+ * connections to every backend open ahead of time, so a client does not
+ * wait for a handshake.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define MAX_BACKENDS 64
+#define RING_POINTS 160             /* per backend: spreads each one's share evenly */
+#define NO_BACKEND UINT_MAX
+
+enum policy {
+    POLICY_ROUND_ROBIN,
+    POLICY_LEAST_CONN,
+    POLICY_HASH,
+};
+
+struct backend {
+    struct sockaddr_in addr;
+    atomic_uint active;         /* relays to it, from every reactor */
+    atomic_bool healthy;
+    struct watch probe;         /* reactor 0's health check, fd -1 between ticks */
+};
+
+struct ring_point {
+    uint32_t hash;
+    unsigned backend;
+};
+
+/* A connection opened ahead of a client. */
+struct warm {
+    struct watch watch;         /* fd -1 once handed over or dropped */
+    struct warm *next;
+    unsigned backend;
+    bool connected;
+};
+
+/* One per reactor, with -W. */
+struct upstream_pool {
+    struct warm *idle[MAX_BACKENDS];
+    unsigned count[MAX_BACKENDS];   /* idle or still connecting */
+    struct warm *retired;           /* freed on the next tick: events may still point at them */
+};
+
+/* One way through the relay. */
+struct direction {
+    int pipe[2];
+    size_t piped;               /* bytes read but not yet written */
+    bool eof;                   /* the source sent its FIN */
+    bool done;                  /* ... and it was passed on */
+};
+
+struct relay {
+    struct watch upstream;
+    struct conn *conn;
+    unsigned backend;
+    unsigned attempts;          /* backends that failed to connect */
+    uint32_t hash;              /* the client's address, with -l hash */
+    bool connected;
+    struct direction up;        /* client to upstream */
+    struct direction down;      /* upstream to client */
+};
+
+unsigned proxy_prewarm;
+
+static struct backend backends[MAX_BACKENDS];
+static unsigned backend_count;
+static enum policy policy = POLICY_ROUND_ROBIN;
+static struct ring_point ring[MAX_BACKENDS * RING_POINTS];
+static _Thread_local unsigned next_backend;
+
+
+static uint32_t mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+
+static int ring_order(const void *a, const void *b) {
+    const struct ring_point *x = a, *y = b;
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+
+static int parse_backend(const char *spec, const size_t len, struct sockaddr_in *addr) {
+    const char *colon = memrchr(spec, ':', len);
+    char host[INET_ADDRSTRLEN];
+    char port_text[8];
+    char *end;
+
+    if (colon == NULL || (size_t) (colon - spec) >= sizeof(host)) return -1;
+    const size_t port_len = len - (size_t) (colon + 1 - spec);
+    if (port_len == 0 || port_len >= sizeof(port_text)) return -1;
+    memcpy(host, spec, (size_t) (colon - spec));
+    host[colon - spec] = '\0';
+    memcpy(port_text, colon + 1, port_len);
+    port_text[port_len] = '\0';
+    const long port = strtol(port_text, &end, 10);
+    if (*end || port <= 0 || port > 65535) return -1;
+
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t) port);
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+
+int proxy_set_upstream(const char *spec) {
+    backend_count = 0;
+    for (const char *p = spec;;) {
+        const char *comma = strchr(p, ',');
+        const size_t len = comma ? (size_t) (comma - p) : strlen(p);
+        if (backend_count == MAX_BACKENDS || parse_backend(p, len, &backends[backend_count].addr)) return -1;
+        backends[backend_count].probe.fd = -1;
+        atomic_init(&backends[backend_count].healthy, true);
+        atomic_init(&backends[backend_count].active, 0);
+        backend_count++;
+        if (comma == NULL) break;
+        p = comma + 1;
+    }
+
+    for (unsigned b = 0; b < backend_count; ++b) {
+        const uint32_t seed = mix32(backends[b].addr.sin_addr.s_addr) ^ backends[b].addr.sin_port;
+        for (unsigned i = 0; i < RING_POINTS; ++i) {
+            ring[b * RING_POINTS + i] = (struct ring_point) { mix32(seed + i * 0x9e3779b9U), b };
+        }
+    }
+    qsort(ring, backend_count * RING_POINTS, sizeof(ring[0]), ring_order);
+    return 0;
+}
+
+
+int proxy_set_policy(const char *name) {
+    if (strcmp(name, "rr") == 0) policy = POLICY_ROUND_ROBIN;
+    else if (strcmp(name, "leastconn") == 0) policy = POLICY_LEAST_CONN;
+    else if (strcmp(name, "hash") == 0) policy = POLICY_HASH;
+    else return -1;
+    return 0;
+}
+
+
+static void backend_mark(const unsigned b, const bool healthy) {
+    if (atomic_exchange(&backends[b].healthy, healthy) == healthy) return;
+    fprintf(stdout, "[%c] Backend %s:%u is %s.\n", healthy ? '*' : '!', inet_ntoa(backends[b].addr.sin_addr),
+            ntohs(backends[b].addr.sin_port), healthy ? "up" : "down");
+}
+
+
+/* Skips unhealthy backends. Returns NO_BACKEND when every one is down;
+ * the probes bring them back.
+ */
+static unsigned pick_backend(const uint32_t hash) {
+    if (policy == POLICY_HASH) {
+        /* One pass round the ring reaches every backend. */
+        const size_t points = backend_count * RING_POINTS;
+        size_t lo = 0, hi = points;
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            if (ring[mid].hash < hash) lo = mid + 1;
+            else hi = mid;
+        }
+        for (size_t i = 0; i < points; ++i) {
+            const unsigned b = ring[(lo + i) % points].backend;
+            if (atomic_load(&backends[b].healthy)) return b;
+        }
+        return NO_BACKEND;
+    }
+
+    /* Round robin; least-connections breaks ties the same way. */
+    const unsigned start = next_backend++;
+    unsigned best = NO_BACKEND, fewest = UINT_MAX;
+    for (unsigned i = 0; i < backend_count; ++i) {
+        const unsigned b = (start + i) % backend_count;
+        if (!atomic_load(&backends[b].healthy)) continue;
+        if (policy != POLICY_LEAST_CONN) return b;
+        const unsigned active = atomic_load(&backends[b].active);
+        if (active < fewest) {
+            fewest = active;
+            best = b;
+        }
+    }
+    return best;
+}
+
+
+/* Starts a non-blocking connect. Returns the socket, or -1. */
+static int backend_connect(const unsigned b) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (const struct sockaddr *) &backends[b].addr, sizeof(backends[b].addr)) == -1
+        && errno != EINPROGRESS) {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+
+static int socket_error(const int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return errno;
+    return err;
+}
+
+
+static int watch_add(struct reactor *reactor, struct watch *watch, const uint32_t events) {
+    struct epoll_event epoll_event = { .events = events, .data.ptr = watch };
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, watch->fd, &epoll_event);
+}
+
+
+static void on_probe_event(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct backend *backend = container_of(watch, struct backend, probe);
+
+    const int err = socket_error(watch->fd);
+    if (!err && !(events & EPOLLERR) && !(events & EPOLLOUT)) return;
+    backend_mark((unsigned) (backend - backends), !err && !(events & EPOLLERR));
+    close(watch->fd);
+    watch->fd = -1;
+}
+
+
+/* A probe still unanswered after a whole tick counts as a failure. */
+static void health_check(struct reactor *reactor) {
+    for (unsigned b = 0; b < backend_count; ++b) {
+        struct watch *probe = &backends[b].probe;
+        if (probe->fd != -1) {
+            close(probe->fd);
+            backend_mark(b, false);
+        }
+        probe->fd = backend_connect(b);
+        probe->on_event = on_probe_event;
+        if (probe->fd == -1) {
+            backend_mark(b, false);
+            continue;
+        }
+        if (watch_add(reactor, probe, EPOLLOUT | EPOLLET)) {
+            close(probe->fd);
+            probe->fd = -1;
+        }
+    }
+}
+
+
+static struct upstream_pool *reactor_upstreams(struct reactor *reactor) {
+    if (reactor->upstreams == NULL) reactor->upstreams = calloc(1, sizeof(*reactor->upstreams));
+    return reactor->upstreams;
+}
+
+
+static void warm_unlink(struct upstream_pool *pool, struct warm *warm) {
+    struct warm **link = &pool->idle[warm->backend];
+    while (*link != warm) link = &(*link)->next;
+    *link = warm->next;
+    pool->count[warm->backend]--;
+    warm->watch.fd = -1;
+    warm->next = pool->retired;
+    pool->retired = warm;
+}
+
+
+/* Drops a warm connection that failed, or that its backend closed. */
+static void on_warm_event(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct warm *warm = container_of(watch, struct warm, watch);
+
+    if (watch->fd == -1) return;
+    const bool failed = events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP) || socket_error(watch->fd);
+    if (!failed) {
+        /* A greeting the backend sends early waits in the socket for the client. */
+        if (events & EPOLLOUT) warm->connected = true;
+        return;
+    }
+    if (!warm->connected) backend_mark(warm->backend, false);
+    close(watch->fd);
+    warm_unlink(reactor->upstreams, warm);
+}
+
+
+static void pool_refill(struct reactor *reactor, const unsigned b) {
+    struct upstream_pool *pool = reactor_upstreams(reactor);
+    if (pool == NULL || !atomic_load(&backends[b].healthy)) return;
+
+    while (pool->count[b] < proxy_prewarm) {
+        struct warm *warm = calloc(1, sizeof(*warm));
+        if (warm == NULL) return;
+        warm->backend = b;
+        warm->watch.on_event = on_warm_event;
+        warm->watch.fd = backend_connect(b);
+        if (warm->watch.fd == -1 || watch_add(reactor, &warm->watch, EPOLLOUT | EPOLLET | EPOLLRDHUP)) {
+            if (warm->watch.fd != -1) close(warm->watch.fd);
+            else backend_mark(b, false);
+            free(warm);
+            return;
+        }
+        warm->next = pool->idle[b];
+        pool->idle[b] = warm;
+        pool->count[b]++;
+    }
+}
+
+
+/* Hands over a connected warm socket to backend b, or returns -1. */
+static int warm_take(struct reactor *reactor, const unsigned b) {
+    struct upstream_pool *pool = reactor->upstreams;
+    if (pool == NULL) return -1;
+
+    for (struct warm *warm = pool->idle[b]; warm; warm = warm->next) {
+        if (!warm->connected) continue;
+        const int fd = warm->watch.fd;
+        warm_unlink(pool, warm);
+        return fd;
+    }
+    return -1;
+}
+
+
+void upstreams_destroy(struct upstream_pool *pool) {
+    if (pool == NULL) return;
+    for (unsigned b = 0; b < MAX_BACKENDS; ++b) {
+        while (pool->idle[b]) {
+            close(pool->idle[b]->watch.fd);
+            warm_unlink(pool, pool->idle[b]);
+        }
+    }
+    while (pool->retired) {
+        struct warm *warm = pool->retired;
+        pool->retired = warm->next;
+        free(warm);
+    }
+    free(pool);
+}
+
+
+/* Moves what src has into dst until neither side takes more. Returns the
+ * bytes written to dst, or -1 on error.
+ */
+static ssize_t relay_pump(struct direction *d, const int src, const int dst) {
+    ssize_t moved = 0;
+    bool progress = true;
+
+    while (progress && !d->done) {
+        progress = false;
+        if (!d->eof) {
+            /* EAGAIN here means an empty source or a full pipe; either way, wait. */
+            const ssize_t n = splice(src, NULL, d->pipe[1], NULL, RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) d->piped += (size_t) n;
+            else if (n == 0) d->eof = true;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+            progress = n >= 0 || errno == EINTR;
+        }
+        if (d->piped) {
+            const ssize_t n = splice(d->pipe[0], NULL, dst, NULL, d->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                d->piped -= (size_t) n;
+                moved += n;
+                progress = true;
+            }
+            else if (errno == EINTR) progress = true;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        }
+        if (d->eof && d->piped == 0) {
+            shutdown(dst, SHUT_WR);
+            d->done = true;
+        }
+    }
+    return moved;
+}
+
+
+static void relay_up(struct reactor *reactor, struct conn *conn) {
+    struct relay *relay = conn->session;
+
+    const ssize_t moved = relay_pump(&relay->up, conn->watch.fd, relay->upstream.fd);
+    if (moved == -1) {
+        perror("relay");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn->bytes += (uint64_t) moved;
+    stat_add(STAT_BYTES_IN, (uint64_t) moved);
+}
+
+
+static void relay_down(struct reactor *reactor, struct conn *conn) {
+    struct relay *relay = conn->session;
+
+    const ssize_t moved = relay_pump(&relay->down, relay->upstream.fd, conn->watch.fd);
+    if (moved == -1) {
+        perror("relay");
+        conn_close(reactor, conn);
+        return;
+    }
+    stat_add(STAT_BYTES_OUT, (uint64_t) moved);
+}
+
+
+/* The pair closes once both FINs have gone through. */
+static void relay_settle(struct reactor *reactor, struct conn *conn) {
+    const struct relay *relay = conn->session;
+
+    if (conn->closed) return;
+    if (relay->up.done && relay->down.done) conn->eof = true;
+    conn_finish(reactor, conn);
+}
+
+
+static void relay_detach(struct relay *relay) {
+    if (relay->upstream.fd == -1) return;
+    close(relay->upstream.fd);
+    relay->upstream.fd = -1;
+    atomic_fetch_sub(&backends[relay->backend].active, 1);
+}
+
+
+/* Connects to a backend, through a warm connection where one is ready,
+ * and moves on to the next backend while connecting fails at once.
+ */
+static int relay_start(struct reactor *reactor, struct relay *relay) {
+    for (; relay->attempts < backend_count; relay->attempts++) {
+        const unsigned b = pick_backend(relay->hash);
+        if (b == NO_BACKEND) break;
+        int fd = warm_take(reactor, b);
+        relay->connected = fd != -1;
+        if (relay->connected) pool_refill(reactor, b);
+        else fd = backend_connect(b);
+        if (fd == -1) {
+            backend_mark(b, false);
+            continue;
+        }
+
+        relay->backend = b;
+        relay->upstream.fd = fd;
+        atomic_fetch_add(&backends[b].active, 1);
+        struct epoll_event epoll_event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP,
+            .data.ptr = &relay->upstream,
+        };
+        if (epoll_ctl(reactor->epoll_fd, relay->connected ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &epoll_event)) {
+            relay_detach(relay);
+            return -1;
+        }
+        return 0;
+    }
+    errno = ECONNREFUSED;
+    return -1;
+}
+
+
+static void on_upstream_event(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct relay *relay = container_of(watch, struct relay, upstream);
+    struct conn *conn = relay->conn;
+
+    /* Closed earlier in this epoll batch. */
+    if (conn->closed) return;
+
+    if (!relay->connected) {
+        const int err = socket_error(watch->fd);
+        if (err || events & EPOLLERR) {
+            /* Nothing has been relayed yet: try the next backend. */
+            backend_mark(relay->backend, false);
+            relay_detach(relay);
+            relay->attempts++;
+            if (relay_start(reactor, relay)) {
+                perror("connect");
+                conn_close(reactor, conn);
+            }
+            return;
+        }
+        if (!(events & EPOLLOUT)) return;
+        /* Whatever the client sent meanwhile is still waiting. */
+        relay->connected = true;
+        events |= EPOLLIN;
+    }
+
+    if (events & EPOLLERR) {
+        conn_close(reactor, conn);
+        return;
+    }
+    if (events & EPOLLOUT) relay_up(reactor, conn);
+    if (!conn->closed && events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) relay_down(reactor, conn);
+    relay_settle(reactor, conn);
+}
+
+
+/* Closes the descriptors only: events later in this batch may still reach
+ * the relay, which is freed along with the connection.
+ */
+static void proxy_close(struct reactor *reactor, struct conn *conn) {
+    struct relay *relay = conn->session;
+    if (relay == NULL) return;
+
+    relay_detach(relay);
+    const int fds[] = { relay->up.pipe[0], relay->up.pipe[1], relay->down.pipe[0], relay->down.pipe[1] };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+        if (fds[i] != -1) close(fds[i]);
+    }
+}
+
+
+static int proxy_open(struct reactor *reactor, struct conn *conn) {
+    struct relay *relay = calloc(1, sizeof(*relay));
+    if (relay == NULL) return -1;
+    relay->conn = conn;
+    relay->upstream.fd = -1;
+    relay->upstream.on_event = on_upstream_event;
+    relay->up.pipe[0] = relay->up.pipe[1] = relay->down.pipe[0] = relay->down.pipe[1] = -1;
+    conn->session = relay;
+    /* The upstream socket is in this reactor's epoll set. */
+    conn->pinned = true;
+
+    if (policy == POLICY_HASH) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        if (getpeername(conn->watch.fd, (struct sockaddr *) &peer, &len) == 0) relay->hash = mix32(peer.sin_addr.s_addr);
+    }
+
+    if (pipe2(relay->up.pipe, O_NONBLOCK | O_CLOEXEC) || pipe2(relay->down.pipe, O_NONBLOCK | O_CLOEXEC)
+        || relay_start(reactor, relay)) {
+        const int err = errno;
+        proxy_close(reactor, conn);
+        errno = err;
+        return -1;
+    }
+    fcntl(relay->up.pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    fcntl(relay->down.pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    return 0;
+}
+
+
+static void proxy_readable(struct reactor *reactor, struct conn *conn) {
+    const struct relay *relay = conn->session;
+
+    if (!relay->connected) return;
+    relay_up(reactor, conn);
+    relay_settle(reactor, conn);
+}
+
+
+static void proxy_writable(struct reactor *reactor, struct conn *conn) {
+    const struct relay *relay = conn->session;
+
+    if (!relay->connected) return;
+    relay_down(reactor, conn);
+    relay_settle(reactor, conn);
+}
+
+
+static void proxy_tick(struct reactor *reactor) {
+    if (reactor->index == 0) health_check(reactor);
+    if (proxy_prewarm == 0) return;
+
+    struct upstream_pool *pool = reactor_upstreams(reactor);
+    while (pool && pool->retired) {
+        struct warm *warm = pool->retired;
+        pool->retired = warm->next;
+        free(warm);
+    }
+    for (unsigned b = 0; b < backend_count; ++b) pool_refill(reactor, b);
+}
+
+
+const struct protocol proxy_protocol = {
+    .name = "proxy",
+    .on_open = proxy_open,
+    .on_readable = proxy_readable,
+    .on_writable = proxy_writable,
+    .on_close = proxy_close,
+    .on_tick = proxy_tick,
+};
@@ -0,0 +1,456 @@
+/**
+ * @file pubsub.c
+ *
+ * @brief Publish/subscribe mode: fan-out through shared, refcounted messages.
+ *
+ * The protocol is one command per line:
+ *
+ *     SUB <pattern>            answered with "+OK <pattern>"
+ *     UNSUB <pattern>          answered with "+OK <pattern>"
+ *     PUB <topic> <payload>    not answered
+ *
+ * and subscribers receive "MSG <topic> <payload>" lines. Topics are
+ * dot-separated; a pattern may use "*" for one segment and a trailing "#"
+ * for the rest (see topic.h). A subscriber whose patterns overlap gets a
+ * message once.
+ *
+ * A published line is formatted once into a refcounted buffer. Every
+ * reactor keeps its own subscribers in a topic trie; the buffer goes to each
+ * reactor that has any, through its channel, and from there into the
+ * output queue of each subscriber as a pointer. Nothing is copied per
+ * subscriber: a subscriber with an empty queue gets one write() straight
+ * from the buffer, the others take a reference and drain their queues with
+ * writev(). A subscriber whose queue passes SUBSCRIBER_QUEUE_MAX bytes
+ * loses new messages, or with -S close, its connection. Replies to its own
+ * commands are never dropped: they are queued past the limit, up to twice
+ * it, and past that the connection is closed.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "server.h"
+#include "topic.h"
+
+#define MAX_LINE (1024 * 1024)
+#define SUBSCRIBER_QUEUE_MAX (4 * 1024 * 1024)
+#define WRITEV_BATCH 64
+
+bool pubsub_close_slow = false;
+
+/* One formatted line, shared by every queue it sits in. */
+struct shared_msg {
+    atomic_uint refs;
+    unsigned topic_len;
+    size_t len;
+    char data[];                /* "MSG <topic> <payload>\n" */
+};
+
+/* A shared message on its way to one other reactor. */
+struct publish {
+    struct message message;
+    struct shared_msg *msg;
+};
+
+struct subscription {
+    struct topic_entry entry;   /* in the reactor's trie */
+    struct conn *conn;
+    struct subscription *next_of_conn;
+    size_t len;
+    char pattern[];
+};
+
+/* Per connection: replies and messages not written yet, oldest first. */
+struct subscriber {
+    struct shared_msg **queue;  /* ring */
+    size_t head;
+    size_t count;
+    size_t size;
+    size_t offset;              /* of the head message, already written */
+    size_t queued;              /* bytes waiting */
+    struct subscription *subs;
+    uint64_t seen;              /* fan-out that last matched it */
+};
+
+static pthread_once_t counts_once = PTHREAD_ONCE_INIT;
+static atomic_uint *subscription_counts;   /* per reactor: publishers skip the ones with none */
+
+/* Per reactor thread: the connections one fan-out matched. */
+static _Thread_local struct conn **matched;
+static _Thread_local size_t matched_count;
+static _Thread_local size_t matched_size;
+static _Thread_local uint64_t fan_out_epoch;
+static pthread_key_t matched_key;          /* frees matched when the thread exits */
+
+
+static void counts_init(void) {
+    subscription_counts = calloc(reactor_count, sizeof(*subscription_counts));
+    if (subscription_counts == NULL || pthread_key_create(&matched_key, free)) {
+        perror("calloc");
+        exit(15);
+    }
+}
+
+
+static void msg_release(struct shared_msg *msg) {
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) free(msg);
+}
+
+
+static struct shared_msg *msg_create(const char *prefix, const char *topic, const size_t topic_len,
+                                     const char *payload, const size_t payload_len) {
+    const size_t prefix_len = strlen(prefix);
+    const size_t len = prefix_len + topic_len + (payload ? 1 + payload_len : 0) + 1;
+    struct shared_msg *msg = malloc(sizeof(*msg) + len);
+    if (msg == NULL) return NULL;
+
+    atomic_init(&msg->refs, 1);
+    msg->topic_len = (unsigned) topic_len;
+    msg->len = len;
+    char *p = msg->data;
+    memcpy(p, prefix, prefix_len);
+    p += prefix_len;
+    memcpy(p, topic, topic_len);
+    p += topic_len;
+    if (payload) {
+        *p++ = ' ';
+        memcpy(p, payload, payload_len);
+        p += payload_len;
+    }
+    *p = '\n';
+    return msg;
+}
+
+
+static const char *msg_topic(const struct shared_msg *msg) {
+    return msg->data + 4;
+}
+
+
+/* Writes from the head of the queue until the socket is full. */
+static int subscriber_drain(struct conn *conn, struct subscriber *sub) {
+    while (sub->count) {
+        struct iovec iov[WRITEV_BATCH];
+        int n = 0;
+        for (size_t i = 0; i < sub->count && n < WRITEV_BATCH; ++i, ++n) {
+            const struct shared_msg *msg = sub->queue[(sub->head + i) % sub->size];
+            const size_t skip = i == 0 ? sub->offset : 0;
+            iov[n] = (struct iovec) { (char *) msg->data + skip, msg->len - skip };
+        }
+
+        ssize_t written = writev(conn->watch.fd, iov, n);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        stat_add(STAT_BYTES_OUT, (uint64_t) written);
+        sub->queued -= (size_t) written;
+        while (written) {
+            struct shared_msg *msg = sub->queue[sub->head];
+            const size_t left = msg->len - sub->offset;
+            if ((size_t) written < left) {
+                sub->offset += (size_t) written;
+                break;
+            }
+            written -= (ssize_t) left;
+            sub->offset = 0;
+            sub->head = (sub->head + 1) % sub->size;
+            sub->count--;
+            msg_release(msg);
+        }
+    }
+    conn->sending = sub->count > 0;
+    return 0;
+}
+
+
+/* Queues a message for the connection, writing it at once if nothing is
+ * ahead of it. Only a published message may be dropped for a full queue.
+ * Returns -1 if the connection should close.
+ */
+static int subscriber_send(struct conn *conn, struct shared_msg *msg, const bool droppable) {
+    struct subscriber *sub = conn->session;
+    size_t written = 0;
+
+    if (sub->count == 0) {
+        const ssize_t n = write(conn->watch.fd, msg->data, msg->len);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+        if (n > 0) {
+            stat_add(STAT_BYTES_OUT, (uint64_t) n);
+            written = (size_t) n;
+        }
+        if (written == msg->len) return 0;
+    }
+    else if (!droppable) {
+        /* A peer that sends commands but never reads its replies. */
+        if (sub->queued + msg->len > 2 * SUBSCRIBER_QUEUE_MAX) return -1;
+    }
+    else if (sub->queued + msg->len > SUBSCRIBER_QUEUE_MAX) {
+        /* A slow subscriber: it misses this message, or is let go. */
+        return pubsub_close_slow ? -1 : 0;
+    }
+
+    if (sub->count == sub->size) {
+        const size_t size = sub->size ? sub->size * 2 : 16;
+        struct shared_msg **queue = malloc(size * sizeof(*queue));
+        if (queue == NULL) return -1;
+        for (size_t i = 0; i < sub->count; ++i) queue[i] = sub->queue[(sub->head + i) % sub->size];
+        free(sub->queue);
+        sub->queue = queue;
+        sub->head = 0;
+        sub->size = size;
+    }
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+    sub->queue[(sub->head + sub->count) % sub->size] = msg;
+    if (sub->count++ == 0) sub->offset = written;
+    sub->queued += msg->len - written;
+    conn->sending = true;
+    return 0;
+}
+
+
+static struct topic_tree *reactor_topics(struct reactor *reactor) {
+    if (reactor->topics == NULL) reactor->topics = topic_tree_create();
+    return reactor->topics;
+}
+
+
+static int subscribe(struct reactor *reactor, struct conn *conn, const char *pattern, const size_t len) {
+    struct subscriber *sub = conn->session;
+    struct topic_tree *tree = reactor_topics(reactor);
+    if (tree == NULL) return -1;
+
+    for (struct subscription *s = sub->subs; s; s = s->next_of_conn) {
+        if (s->len == len && memcmp(s->pattern, pattern, len) == 0) return 0;
+    }
+    struct subscription *s = malloc(sizeof(*s) + len);
+    if (s == NULL) return -1;
+    if (topic_subscribe(tree, &s->entry, pattern, len)) {
+        free(s);
+        return -1;
+    }
+    s->conn = conn;
+    s->len = len;
+    memcpy(s->pattern, pattern, len);
+    s->next_of_conn = sub->subs;
+    sub->subs = s;
+    atomic_fetch_add_explicit(&subscription_counts[reactor->index], 1, memory_order_relaxed);
+    return 0;
+}
+
+
+static void unsubscribe(struct reactor *reactor, struct conn *conn, const char *pattern, const size_t len) {
+    struct subscriber *sub = conn->session;
+
+    for (struct subscription **link = &sub->subs; *link; link = &(*link)->next_of_conn) {
+        struct subscription *s = *link;
+        if (s->len != len || memcmp(s->pattern, pattern, len) != 0) continue;
+        *link = s->next_of_conn;
+        topic_unsubscribe(reactor->topics, &s->entry);
+        free(s);
+        atomic_fetch_sub_explicit(&subscription_counts[reactor->index], 1, memory_order_relaxed);
+        return;
+    }
+}
+
+
+/* Match callback: collects each connection once per fan-out. */
+static void collect(struct topic_entry *entry, void *arg) {
+    struct shared_msg *msg = arg;
+    struct conn *conn = container_of(entry, struct subscription, entry)->conn;
+    struct subscriber *sub = conn->session;
+
+    if (sub->seen == fan_out_epoch) return;
+    sub->seen = fan_out_epoch;
+    if (matched_count == matched_size) {
+        const size_t size = matched_size ? matched_size * 2 : 64;
+        struct conn **grown = realloc(matched, size * sizeof(*grown));
+        if (grown == NULL) {
+            /* No room to send after the walk: send now. A subscriber to let go
+             * is shut down instead, and closed on the hang-up that follows.
+             */
+            if (subscriber_send(conn, msg, true)) shutdown(conn->watch.fd, SHUT_RDWR);
+            return;
+        }
+        matched = grown;
+        matched_size = size;
+        pthread_setspecific(matched_key, matched);
+    }
+    matched[matched_count++] = conn;
+}
+
+
+/* Hands the message to every local subscriber whose pattern matches. */
+static void fan_out(struct reactor *reactor, struct shared_msg *msg) {
+    if (reactor->topics == NULL) return;
+
+    /* Sends come after the walk: closing a subscriber changes the trie. */
+    fan_out_epoch++;
+    matched_count = 0;
+    topic_match(reactor->topics, msg_topic(msg), msg->topic_len, collect, msg);
+    for (size_t i = 0; i < matched_count; ++i) {
+        if (subscriber_send(matched[i], msg, true)) conn_close(reactor, matched[i]);
+    }
+}
+
+
+static void deliver_publish(struct reactor *reactor, struct message *message) {
+    struct publish *publish = container_of(message, struct publish, message);
+
+    fan_out(reactor, publish->msg);
+    msg_release(publish->msg);
+    free(publish);
+}
+
+
+static void publish(struct reactor *reactor, struct shared_msg *msg) {
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        if (i == reactor->index || atomic_load_explicit(&subscription_counts[i], memory_order_relaxed) == 0) continue;
+        struct publish *p = malloc(sizeof(*p));
+        if (p == NULL) continue;
+        atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+        p->msg = msg;
+        p->message.deliver = deliver_publish;
+        reactor_submit(reactor, i, &p->message);
+    }
+    fan_out(reactor, msg);
+    msg_release(msg);
+}
+
+
+static int reply(struct conn *conn, const char *prefix, const char *topic, const size_t topic_len) {
+    struct shared_msg *msg = msg_create(prefix, topic, topic_len, NULL, 0);
+    if (msg == NULL) return -1;
+    const int rc = subscriber_send(conn, msg, false);
+    msg_release(msg);
+    return rc;
+}
+
+
+/* Runs one command line, without its '\n'. Returns -1 to close. */
+static int execute(struct reactor *reactor, struct conn *conn, const char *line, size_t len) {
+    if (len && line[len - 1] == '\r') len--;
+    const char *sp = memchr(line, ' ', len);
+    if (sp == NULL) return reply(conn, "-ERR ", "syntax", 6) ? -1 : 0;
+
+    const size_t cmd_len = (size_t) (sp - line);
+    const char *topic = sp + 1;
+    size_t topic_len = len - cmd_len - 1;
+    const char *payload = NULL;
+    size_t payload_len = 0;
+    if (cmd_len == 3 && memcmp(line, "PUB", 3) == 0) {
+        const char *end = memchr(topic, ' ', topic_len);
+        payload = end ? end + 1 : topic + topic_len;
+        payload_len = end ? (size_t) (line + len - payload) : 0;
+        topic_len = end ? (size_t) (end - topic) : topic_len;
+    }
+    if (payload) {
+        if (!topic_valid(topic, topic_len)) return reply(conn, "-ERR ", "topic", 5) ? -1 : 0;
+        struct shared_msg *msg = msg_create("MSG ", topic, topic_len, payload, payload_len);
+        if (msg == NULL) return -1;
+        publish(reactor, msg);
+        return 0;
+    }
+    if (cmd_len == 3 && memcmp(line, "SUB", 3) == 0) {
+        if (subscribe(reactor, conn, topic, topic_len)) {
+            if (errno != EINVAL) return -1;
+            return reply(conn, "-ERR ", "topic", 5) ? -1 : 0;
+        }
+        return reply(conn, "+OK ", topic, topic_len);
+    }
+    if (cmd_len == 5 && memcmp(line, "UNSUB", 5) == 0) {
+        unsubscribe(reactor, conn, topic, topic_len);
+        return reply(conn, "+OK ", topic, topic_len);
+    }
+    return reply(conn, "-ERR ", "command", 7) ? -1 : 0;
+}
+
+
+static int pubsub_open(struct reactor *reactor, struct conn *conn) {
+    pthread_once(&counts_once, counts_init);
+    conn->session = calloc(1, sizeof(struct subscriber));
+    /* Its subscriptions are in this reactor's trie. */
+    conn->pinned = true;
+    return conn->session ? 0 : -1;
+}
+
+
+static void pubsub_readable(struct reactor *reactor, struct conn *conn) {
+    size_t used = 0;
+
+    if (conn_fill(conn)) {
+        perror("read");
+        conn_close(reactor, conn);
+        return;
+    }
+    while (used < conn->in_len) {
+        const char *line = conn->in + used;
+        const char *nl = memchr(line, '\n', conn->in_len - used);
+        if (nl == NULL) {
+            if (conn->in_len - used <= MAX_LINE) break;
+            conn_close(reactor, conn);
+            return;
+        }
+        if (execute(reactor, conn, line, (size_t) (nl - line))) {
+            conn_close(reactor, conn);
+            return;
+        }
+        /* Its own publish found it too slow. */
+        if (conn->closed) return;
+        used += (size_t) (nl - line) + 1;
+    }
+    conn_consume(conn, used);
+    conn_finish(reactor, conn);
+}
+
+
+static void pubsub_writable(struct reactor *reactor, struct conn *conn) {
+    if (subscriber_drain(conn, conn->session)) {
+        perror("writev");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+static void pubsub_close(struct reactor *reactor, struct conn *conn) {
+    struct subscriber *sub = conn->session;
+    if (sub == NULL) return;
+
+    while (sub->subs) {
+        struct subscription *s = sub->subs;
+        sub->subs = s->next_of_conn;
+        topic_unsubscribe(reactor->topics, &s->entry);
+        free(s);
+        atomic_fetch_sub_explicit(&subscription_counts[reactor->index], 1, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < sub->count; ++i) msg_release(sub->queue[(sub->head + i) % sub->size]);
+    free(sub->queue);
+    free(sub);
+    conn->session = NULL;
+    conn->sending = false;
+}
+
+
+const struct protocol pubsub_protocol = {
+    .name = "pubsub",
+    .on_open = pubsub_open,
+    .on_readable = pubsub_readable,
+    .on_writable = pubsub_writable,
+    .on_close = pubsub_close,
+};
@@ -0,0 +1,214 @@
+/**
+ * @file queue.h
+ *
+ * @brief Lock-free queues for handing work between threads.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define CACHE_LINE 64
+
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+
+/* Intrusive multi-producer single-consumer queue (Vyukov).
+ * Producers never block each other; only the owning thread may pop.
+ */
+struct mpsc_node {
+    _Atomic(struct mpsc_node *) next;
+};
+
+/* Producers only touch head, the consumer only tail: keep them on separate lines. */
+struct mpsc_queue {
+    alignas(CACHE_LINE) _Atomic(struct mpsc_node *) head;
+    alignas(CACHE_LINE) struct mpsc_node *tail;
+    struct mpsc_node stub;
+};
+
+
+static inline void mpsc_init(struct mpsc_queue *q) {
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct mpsc_node *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+
+/* Returns NULL when the queue is empty or a producer is half way through a push;
+ * in the latter case the producer's wakeup will bring the consumer back.
+ */
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q) {
+    struct mpsc_node *tail = q->tail;
+    struct mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+/* Bounded single-producer single-consumer ring.
+ * Each side keeps a private copy of the other side's index and only reloads
+ * the shared one when the copy says full/empty, so in the steady state the
+ * two threads do not bounce each other's cache lines.
+ */
+struct spsc_ring {
+    alignas(CACHE_LINE) atomic_size_t head;     /* next slot to write, producer */
+    size_t tail_cache;
+    alignas(CACHE_LINE) atomic_size_t tail;     /* next slot to read, consumer */
+    size_t head_cache;
+    alignas(CACHE_LINE) size_t mask;
+    void **slots;
+};
+
+
+/* size must be a power of two. */
+static inline int spsc_init(struct spsc_ring *ring, const size_t size) {
+    ring->slots = calloc(size, sizeof(*ring->slots));
+    if (ring->slots == NULL) return -1;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->tail_cache = 0;
+    ring->head_cache = 0;
+    return 0;
+}
+
+
+static inline void spsc_free(struct spsc_ring *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+
+/* Producer side. Returns false when the ring is full. */
+static inline bool spsc_push(struct spsc_ring *ring, void *item) {
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - ring->tail_cache > ring->mask) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_cache > ring->mask) return false;
+    }
+    ring->slots[head & ring->mask] = item;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+
+/* Consumer side. Returns NULL when the ring is empty. */
+static inline void *spsc_pop(struct spsc_ring *ring) {
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->head_cache) return NULL;
+    }
+    void *item = ring->slots[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return item;
+}
+
+
+/* An eventfd a consumer sleeps on in epoll_wait.
+ * Only the ring that finds the doorbell quiet writes the eventfd; the rest
+ * ride on that wakeup, so a burst of posts costs one syscall, not one each.
+ */
+struct doorbell {
+    alignas(CACHE_LINE) atomic_bool signalled;
+    int event_fd;
+};
+
+
+static inline int doorbell_init(struct doorbell *bell) {
+    atomic_init(&bell->signalled, false);
+    bell->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return bell->event_fd == -1 ? -1 : 0;
+}
+
+
+/* Wakes the consumer on the empty -> non-empty transition only.
+ * Returns true when this call wrote the eventfd.
+ */
+static inline bool doorbell_ring(struct doorbell *bell) {
+    if (atomic_exchange(&bell->signalled, true)) return false;
+    eventfd_write(bell->event_fd, 1);
+    return true;
+}
+
+
+/* Consumes the wakeup and re-arms it; call before draining the queue.
+ * A post racing with the drain either lands in it or rings again.
+ */
+static inline void doorbell_clear(struct doorbell *bell) {
+    eventfd_t value;
+    eventfd_read(bell->event_fd, &value);
+    atomic_store(&bell->signalled, false);
+}
+
+
+/* MPSC queue paired with a doorbell. */
+struct mailbox {
+    struct mpsc_queue queue;
+    struct doorbell bell;
+};
+
+
+static inline int mailbox_init(struct mailbox *mb) {
+    mpsc_init(&mb->queue);
+    return doorbell_init(&mb->bell);
+}
+
+
+static inline void mailbox_post(struct mailbox *mb, struct mpsc_node *node) {
+    mpsc_push(&mb->queue, node);
+    doorbell_ring(&mb->bell);
+}
+
+
+static inline void mailbox_clear(struct mailbox *mb) {
+    doorbell_clear(&mb->bell);
+}
+
+
+static inline struct mpsc_node *mailbox_pop(struct mailbox *mb) {
+    return mpsc_pop(&mb->queue);
+}
+
+#endif /* QUEUE_H */
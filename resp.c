@@ -0,0 +1,358 @@
+/**
+ * @file resp.c
+ *
+ * @brief Redis protocol (RESP) mode: PING, ECHO, GET, SET and DEL.
+ *
+ * Commands are parsed in place: arguments are slices of the connection's
+ * receive buffer, never copied. An incomplete command stays in the buffer
+ * until the rest arrives. Every command that is complete after a read is
+ * answered into the output buffer, and the replies go out in one write, so a
+ * pipelined client gets a batch back per batch it sent.
+ *
+ * With -J, every SET and DEL that changes the store is journaled as the
+ * frame it arrived in, and the connection's replies wait until the end of
+ * the epoll batch, when one journal commit makes all of the batch's writes
+ * durable. On startup the journal is replayed into the store.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "journal.h"
+#include "server.h"
+#include "store.h"
+
+#define RESP_MAX_ARGS 16
+#define RESP_MAX_BULK (512 * 1024 * 1024)
+#define RESP_MAX_INLINE (64 * 1024)
+
+
+struct slice {
+    const char *data;
+    size_t len;
+};
+
+static bool journaling;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t held_key;              /* frees held when the thread exits */
+
+/* Per reactor thread: connections whose replies wait for the journal. */
+static _Thread_local struct conn **held;
+static _Thread_local size_t held_count;
+static _Thread_local size_t held_size;
+static _Thread_local uint64_t held_seq;     /* last record they wait for */
+
+
+/* Returns the '\r' of the first CRLF at or after p, or NULL if there is none yet. */
+static const char *find_crlf(const char *p, const char *end) {
+    while (p < end) {
+        const char *cr = memchr(p, '\r', (size_t) (end - p));
+        if (cr == NULL || cr + 1 >= end) return NULL;
+        if (cr[1] == '\n') return cr;
+        p = cr + 1;
+    }
+    return NULL;
+}
+
+
+static bool parse_number(const char *p, const char *end, long long *out) {
+    bool negative = false;
+    long long value = 0;
+
+    if (p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    if (p == end || end - p > 18) return false;
+    for (; p < end; ++p) {
+        if (*p < '0' || *p > '9') return false;
+        value = value * 10 + (*p - '0');
+    }
+    *out = negative ? -value : value;
+    return true;
+}
+
+
+/* Keeps the first RESP_MAX_ARGS words; more leave *argc at RESP_MAX_ARGS + 1. */
+static void add_arg(struct slice *argv, int *argc, const char *data, const size_t len) {
+    if (*argc < RESP_MAX_ARGS) argv[(*argc)++] = (struct slice) { data, len };
+    else *argc = RESP_MAX_ARGS + 1;
+}
+
+
+/* "*<n>\r\n" followed by n "$<len>\r\n<bytes>\r\n". */
+static ssize_t parse_array(const char *buf, const char *end, struct slice *argv, int *argc) {
+    long long count, len;
+
+    const char *line = find_crlf(buf + 1, end);
+    if (line == NULL) return 0;
+    if (!parse_number(buf + 1, line, &count)) return -1;
+
+    const char *p = line + 2;
+    *argc = 0;
+    for (long long i = 0; i < count; ++i) {
+        if (p >= end) return 0;
+        if (*p != '$') return -1;
+        line = find_crlf(p + 1, end);
+        if (line == NULL) return 0;
+        if (!parse_number(p + 1, line, &len) || len < 0 || len > RESP_MAX_BULK) return -1;
+        p = line + 2;
+        if (end - p < len + 2) return 0;
+        if (p[len] != '\r' || p[len + 1] != '\n') return -1;
+        add_arg(argv, argc, p, (size_t) len);
+        p += len + 2;
+    }
+    return p - buf;
+}
+
+
+/* A line of space-separated words, as typed into telnet. */
+static ssize_t parse_inline(const char *buf, const char *end, struct slice *argv, int *argc) {
+    const char *nl = memchr(buf, '\n', (size_t) (end - buf));
+    if (nl == NULL) return end - buf > RESP_MAX_INLINE ? -1 : 0;
+
+    const char *stop = nl > buf && nl[-1] == '\r' ? nl - 1 : nl;
+    const char *p = buf;
+    *argc = 0;
+    while (p < stop) {
+        while (p < stop && *p == ' ') p++;
+        if (p == stop) break;
+        const char *word = p;
+        while (p < stop && *p != ' ') p++;
+        add_arg(argv, argc, word, (size_t) (p - word));
+    }
+    return nl + 1 - buf;
+}
+
+
+/* Returns the bytes one command takes, 0 if it is not complete yet, -1 if malformed.
+ * A command with too many arguments is still consumed whole, so the stream stays in step.
+ */
+static ssize_t parse_command(const char *buf, const size_t len, struct slice *argv, int *argc) {
+    if (buf[0] == '*') return parse_array(buf, buf + len, argv, argc);
+    return parse_inline(buf, buf + len, argv, argc);
+}
+
+
+static bool is(const struct slice *word, const char *name) {
+    return word->len == strlen(name) && strncasecmp(word->data, name, word->len) == 0;
+}
+
+
+static void reply(struct conn *conn, const char *text) {
+    conn_queue(conn, text, strlen(text));
+}
+
+
+static void reply_bulk(void *ctx, const char *data, const size_t len) {
+    struct conn *conn = ctx;
+    char header[32];
+
+    const int n = snprintf(header, sizeof(header), "$%zu\r\n", len);
+    conn_queue(conn, header, (size_t) n);
+    conn_queue(conn, data, len);
+    conn_queue(conn, "\r\n", 2);
+}
+
+
+static void reply_integer(struct conn *conn, const long long value) {
+    char line[32];
+    const int n = snprintf(line, sizeof(line), ":%lld\r\n", value);
+    conn_queue(conn, line, (size_t) n);
+}
+
+
+static void reply_arity(struct conn *conn, const struct slice *name) {
+    char line[128];
+    const int n = snprintf(line, sizeof(line), "-ERR wrong number of arguments for '%.*s' command\r\n",
+                           (int) (name->len > 32 ? 32 : name->len), name->data);
+    conn_queue(conn, line, (size_t) n);
+}
+
+
+/* Applies a SET or DEL. Returns the keys it changed, -1 when out of memory. */
+static long long apply(const struct slice *argv, const int argc) {
+    long long changed = 0;
+
+    if (is(&argv[0], "SET")) return store_set(argv[1].data, argv[1].len, argv[2].data, argv[2].len) ? -1 : 1;
+    if (is(&argv[0], "DEL")) {
+        for (int i = 1; i < argc; ++i) changed += store_delete(argv[i].data, argv[i].len);
+    }
+    return changed;
+}
+
+
+static void replay(const char *record, const size_t len) {
+    struct slice argv[RESP_MAX_ARGS];
+    int argc;
+
+    if (parse_command(record, len, argv, &argc) > 0 && argc && argc <= RESP_MAX_ARGS) apply(argv, argc);
+}
+
+
+/* Holds the connection's replies until the journal commit at the end of the batch. */
+static void hold(struct conn *conn, const uint64_t seq) {
+    held_seq = seq;
+    if (conn->held) return;
+    if (held_count == held_size) {
+        const size_t size = held_size ? held_size * 2 : 64;
+        struct conn **grown = realloc(held, size * sizeof(*grown));
+        if (grown == NULL) {
+            /* Commit alone rather than reply early. */
+            if (journal_commit(seq)) {
+                perror("journal_commit");
+                exit(16);
+            }
+            return;
+        }
+        held = grown;
+        held_size = size;
+        pthread_setspecific(held_key, held);
+    }
+    held[held_count++] = conn;
+    conn->held = true;
+}
+
+
+/* Runs a SET or DEL. With -J the change and its journal record are made
+ * under one lock, so replay applies changes in the order they were made.
+ */
+static long long write_command(struct conn *conn, const struct slice *argv, const int argc,
+                               const char *frame, const size_t frame_len) {
+    if (!journaling) return apply(argv, argc);
+
+    pthread_mutex_lock(&write_lock);
+    long long changed = apply(argv, argc);
+    if (changed > 0) {
+        const uint64_t seq = journal_append(frame, frame_len);
+        if (seq) hold(conn, seq);
+        else changed = -1;
+    }
+    pthread_mutex_unlock(&write_lock);
+    return changed;
+}
+
+
+static void execute(struct conn *conn, const struct slice *argv, const int argc, const char *frame,
+                    const size_t frame_len) {
+    if (is(&argv[0], "PING")) {
+        if (argc == 1) reply(conn, "+PONG\r\n");
+        else if (argc == 2) reply_bulk(conn, argv[1].data, argv[1].len);
+        else reply_arity(conn, &argv[0]);
+    }
+    else if (is(&argv[0], "ECHO")) {
+        if (argc == 2) reply_bulk(conn, argv[1].data, argv[1].len);
+        else reply_arity(conn, &argv[0]);
+    }
+    else if (is(&argv[0], "GET")) {
+        if (argc != 2) reply_arity(conn, &argv[0]);
+        else if (!store_get(argv[1].data, argv[1].len, reply_bulk, conn)) reply(conn, "$-1\r\n");
+    }
+    else if (is(&argv[0], "SET")) {
+        /* Options such as EX are accepted and ignored. */
+        if (argc < 3) reply_arity(conn, &argv[0]);
+        else if (write_command(conn, argv, argc, frame, frame_len) < 0) reply(conn, "-ERR out of memory\r\n");
+        else reply(conn, "+OK\r\n");
+    }
+    else if (is(&argv[0], "DEL")) {
+        if (argc < 2) reply_arity(conn, &argv[0]);
+        else {
+            const long long deleted = write_command(conn, argv, argc, frame, frame_len);
+            if (deleted < 0) reply(conn, "-ERR out of memory\r\n");
+            else reply_integer(conn, deleted);
+        }
+    }
+    else {
+        char line[128];
+        const int n = snprintf(line, sizeof(line), "-ERR unknown command '%.*s'\r\n",
+                               (int) (argv[0].len > 32 ? 32 : argv[0].len), argv[0].data);
+        conn_queue(conn, line, (size_t) n);
+    }
+}
+
+
+static void resp_readable(struct reactor *reactor, struct conn *conn) {
+    struct slice argv[RESP_MAX_ARGS];
+    size_t used = 0;
+    int argc;
+
+    if (conn_fill(conn)) {
+        perror("read");
+        conn_close(reactor, conn);
+        return;
+    }
+
+    while (used < conn->in_len) {
+        const ssize_t n = parse_command(conn->in + used, conn->in_len - used, argv, &argc);
+        if (n == 0) break;
+        if (n < 0) {
+            /* Nothing after a framing error can be trusted: answer and hang up. */
+            reply(conn, "-ERR Protocol error\r\n");
+            conn->eof = true;
+            used = conn->in_len;
+            break;
+        }
+        if (argc > RESP_MAX_ARGS) reply_arity(conn, &argv[0]);
+        else if (argc) execute(conn, argv, argc, conn->in + used, (size_t) n);
+        used += (size_t) n;
+    }
+    conn_consume(conn, used);
+
+    /* Replies to journaled writes go out in resp_batch(). */
+    if (conn->held) return;
+    if (conn_flush(conn)) {
+        perror("conn_flush");
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+/* Group commit: one journal commit for every write of the batch, then the
+ * replies that waited for it.
+ */
+static void resp_batch(struct reactor *reactor) {
+    if (held_count == 0) return;
+
+    if (journal_commit(held_seq)) {
+        /* Acknowledged writes could be lost from here on. */
+        perror("journal_commit");
+        exit(16);
+    }
+    for (size_t i = 0; i < held_count; ++i) {
+        struct conn *conn = held[i];
+        conn->held = false;
+        if (conn->closed) continue;
+        if (conn_flush(conn)) {
+            perror("conn_flush");
+            conn_close(reactor, conn);
+            continue;
+        }
+        conn_finish(reactor, conn);
+    }
+    held_count = 0;
+}
+
+
+int resp_journal_open(const char *dir) {
+    if (pthread_key_create(&held_key, free) || journal_open(dir, replay)) return -1;
+    journaling = true;
+    return 0;
+}
+
+
+const struct protocol resp_protocol = {
+    .name = "resp",
+    .on_readable = resp_readable,
+    .on_batch = resp_batch,
+};
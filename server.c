@@ -3,6 +3,8 @@
  *
  * @brief Simple TCP echo server using epoll and non-blocking I/O.
  *
+ * Build: cc -O2 -pthread -o server server.c pool.c stats.c coro.c resp.c store.c memcache.c cache.c http.c stream.c file.c proxy.c pubsub.c topic.c journal.c
+ *
  * @author WhiteMonsterZeroUltraEnergy
  * @license MIT
  *
@@ -32,26 +34,84 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "coro.h"
+#include "journal.h"
+#include "server.h"
+#include "topic.h"
 
 #define PORT 3490
-#define BUFFER_SIZE 1024
+#define IN_BUFFER_SIZE 16384
+#define MAX_INPUT (64 * 1024 * 1024)
+#define OUT_HIGH_WATER (4 * 1024 * 1024)
+#define OUT_LOW_WATER (1024 * 1024)
 #define MAX_EVENTS 10
+#define TICK_MS 1000
+#define BALANCE_INTERVAL_MS 2000
+#define SUPERVISE_INTERVAL_MS 100
+#define CHANNEL_SIZE 256
+#define HASH_REPLY_LEN 17       /* 16 hex digits and a newline */
 
 
 /* Flag to control the main loop when receiving SIGINT (Ctrl+C). */
 volatile sig_atomic_t keep_running = 1;
 
+/* Set by SIGUSR1: print the statistics gathered so far. */
+volatile sig_atomic_t report_requested = 0;
+
+/* How new connections are spread over the reactors.
+ * Exclusive against reuseport, measured on one CPU only (server -t 4,
+ * client -c 4 -e -T 4): 14156 against 14196 connects/s, p99 connect 400
+ * against 320 us, the same within noise. Reuseport split accepts within 5%
+ * per reactor; EPOLLEXCLUSIVE favours whichever reactor waits first, so its
+ * split was 16414/15131/13355/11741. Its benefit, balance under uneven
+ * per-connection cost on several cores, is unmeasured.
+ */
+enum dispatch {
+    DISPATCH_REUSEPORT,     /* a listener per reactor, the kernel hashes between them */
+    DISPATCH_EXCLUSIVE,     /* one listener in every epoll set, EPOLLEXCLUSIVE wakes one idle reactor */
+    DISPATCH_CPU,           /* reuseport listeners, a BPF program picks the receiving CPU's reactor */
+    DISPATCH_ONESHOT,       /* one epoll set for all threads, connections armed EPOLLONESHOT */
+};
+
+struct reactor *reactors;
+unsigned reactor_count = 1;
+enum dispatch dispatch = DISPATCH_REUSEPORT;
+bool coroutines = false;        /* -c: one coroutine per connection runs the handler */
+const struct protocol *protocol = &echo_protocol;
+bool prefork_worker = false;    /* the master does the reporting */
+
+/* Whole lines travelling through the pool, and their hashes coming back. */
+struct request {
+    struct task task;
+    struct conn *conn;
+    struct request *next;
+    uint64_t seq;
+    size_t len;
+    char data[BUFFER_SIZE];
+};
+
 
 /* Signal handling ensuring safe shutdown. */
 void handle_sigint(int sig) {
@@ -59,6 +119,11 @@ void handle_sigint(int sig) {
 }
 
 
+void handle_sigusr1(int sig) {
+    report_requested = 1;
+}
+
+
 /* Sets the file descriptor to non-blocking mode. */
 int set_nonblock(const int fd) {
     const int flags = fcntl(fd, F_GETFL, 0);
@@ -67,8 +132,10 @@ int set_nonblock(const int fd) {
 }
 
 
-/* It sends all data through the socket. */
-int send_all(const int socket, const void *msg, const size_t len) {
+/* Writes as much of the data as the socket takes right now.
+ * Returns the number of bytes written, or -1 on error.
+ */
+ssize_t send_some(const int socket, const void *msg, const size_t len) {
     const char *data = msg;
     size_t total_sent = 0;
 
@@ -76,152 +143,1346 @@ int send_all(const int socket, const void *msg, const size_t len) {
         const ssize_t bytes_sent = write(socket, data + total_sent, len - total_sent);
         if (bytes_sent < 0) {
             if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             return -1;
         }
-        /* socket is closed */
-        if (bytes_sent == 0) {
+        total_sent += (size_t) bytes_sent;
+    }
+    return (ssize_t) total_sent;
+}
+
+
+/* Appends to the output buffer without touching the socket. */
+int conn_queue(struct conn *conn, const void *msg, const size_t len) {
+    if (conn->out_len + len > conn->out_size) {
+        size_t size = conn->out_size ? conn->out_size : BUFFER_SIZE;
+        while (size < conn->out_len + len) size *= 2;
+        char *out = realloc(conn->out, size);
+        if (out == NULL) return -1;
+        conn->out = out;
+        conn->out_size = size;
+    }
+    memcpy(conn->out + conn->out_len, msg, len);
+    conn->out_len += len;
+    return 0;
+}
+
+
+/* Sends data to the peer, keeping whatever the socket refuses for EPOLLOUT.
+ * Data already waiting goes out first so the stream stays in order.
+ */
+int conn_send(struct conn *conn, const void *msg, const size_t len) {
+    size_t sent = 0;
+
+    if (conn->out_len == 0) {
+        const ssize_t bytes_sent = send_some(conn->watch.fd, msg, len);
+        if (bytes_sent < 0) return -1;
+        sent = (size_t) bytes_sent;
+        stat_add(STAT_BYTES_OUT, sent);
+        if (sent == len) return 0;
+    }
+    return conn_queue(conn, (const char *) msg + sent, len - sent);
+}
+
+
+/* Reads until the socket is drained, growing the input buffer as needed. */
+int conn_fill(struct conn *conn) {
+    while (!conn->eof) {
+        if (conn->in_len == conn->in_size) {
+            const size_t size = conn->in_size ? conn->in_size * 2 : IN_BUFFER_SIZE;
+            if (size > MAX_INPUT) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            char *in = realloc(conn->in, size);
+            if (in == NULL) return -1;
+            conn->in = in;
+            conn->in_size = size;
+        }
+
+        const ssize_t bytes_received = read(conn->watch.fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+        if (bytes_received > 0) {
+            conn->in_len += (size_t) bytes_received;
+            conn->bytes += (uint64_t) bytes_received;
+            stat_add(STAT_BYTES_IN, (uint64_t) bytes_received);
+            continue;
+        }
+        if (bytes_received == 0) {
+            conn->eof = true;
             break;
         }
-        total_sent += (size_t) bytes_sent;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -1;
     }
-    return (total_sent == len) ? 0 : -1;
+    return 0;
+}
+
+
+void conn_consume(struct conn *conn, const size_t used) {
+    conn->in_len -= used;
+    memmove(conn->in, conn->in + used, conn->in_len);
 }
 
+
+/* Pushes buffered output once the socket is writable again. */
+int conn_flush(struct conn *conn) {
+    if (conn->out_len == 0) return 0;
+
+    const ssize_t bytes_sent = send_some(conn->watch.fd, conn->out, conn->out_len);
+    if (bytes_sent < 0) return -1;
+    stat_add(STAT_BYTES_OUT, (uint64_t) bytes_sent);
+    conn->out_len -= (size_t) bytes_sent;
+    memmove(conn->out, conn->out + bytes_sent, conn->out_len);
+    return 0;
+}
+
+
+/* In the shared epoll set a connection is disarmed after every event, so at
+ * most one thread handles it at a time. Level-triggered: EPOLLOUT is only
+ * asked for while there is output waiting, or always for a protocol that
+ * streams.
+ */
+uint32_t oneshot_events(const struct conn *conn) {
+    const bool output = conn->out_len || conn->waiting == EPOLLOUT || protocol->on_writable;
+    const uint32_t input = conn->throttled ? 0 : EPOLLIN | EPOLLRDHUP;
+    return input | EPOLLONESHOT | (output ? EPOLLOUT : 0);
+}
+
+
+uint32_t conn_events(const struct conn *conn) {
+    if (dispatch == DISPATCH_ONESHOT) return oneshot_events(conn);
+    return (conn->throttled ? 0 : EPOLLIN | EPOLLRDHUP) | EPOLLOUT | EPOLLET;
+}
+
+
+/* Output not on the wire yet: queued bytes and requests still in the pool. */
+size_t conn_backlog(const struct conn *conn) {
+    return conn->out_len + (size_t) conn->inflight * BUFFER_SIZE;
+}
+
+
+/* Past the high-water mark a connection stops asking for input until its
+ * backlog drains below the low-water mark, so a peer that sends without
+ * reading cannot grow the output buffer without bound.
+ */
+void conn_throttle(struct reactor *reactor, struct conn *conn, const bool throttled) {
+    struct epoll_event epoll_event;
+
+    if (conn->throttled == throttled) return;
+    conn->throttled = throttled;
+    /* The shared set picks the change up when the connection is re-armed. */
+    if (dispatch == DISPATCH_ONESHOT) return;
+    epoll_event.data.ptr = &conn->watch;
+    epoll_event.events = conn_events(conn);
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->watch.fd, &epoll_event)) {
+        perror("epoll_ctl");
+        conn_close(reactor, conn);
+    }
+}
+
+
 /* Closes the connection with socket */
 void close_socket(const int fd, const int epoll_fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
     shutdown(fd, SHUT_RDWR);
     close(fd);
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
 }
 
-int main(void) {
-    struct sockaddr_in server_addr, peer_addr;
-    socklen_t addr_len = sizeof(peer_addr);
+
+void conn_free(struct conn *conn) {
+    coro_destroy(conn->co);
+    free(conn->in);
+    free(conn->out);
+    free(conn->session);
+    free(conn);
+}
+
+
+void conn_link(struct reactor *reactor, struct conn *conn) {
+    conn->prev = NULL;
+    conn->next = reactor->conns;
+    if (reactor->conns) reactor->conns->prev = conn;
+    reactor->conns = conn;
+}
+
+
+void conn_unlink(struct reactor *reactor, struct conn *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else reactor->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+}
+
+
+/* Later events in the same epoll batch may still point at the connection,
+ * so it is only queued here and freed by reap_conns().
+ */
+void conn_release(struct reactor *reactor, struct conn *conn) {
+    conn->next_dead = reactor->dead;
+    reactor->dead = conn;
+}
+
+
+void reap_conns(struct reactor *reactor) {
+    while (reactor->dead) {
+        struct conn *conn = reactor->dead;
+        reactor->dead = conn->next_dead;
+        conn_free(conn);
+    }
+}
+
+
+/* Closes the socket now; the state lives on until the pool hands back
+ * every request that still points at it.
+ */
+void conn_close(struct reactor *reactor, struct conn *conn) {
+    if (conn->closed) return;
+    if (protocol->on_close) protocol->on_close(reactor, conn);
+    close_socket(conn->watch.fd, reactor->epoll_fd);
+    conn->closed = true;
+    if (dispatch != DISPATCH_ONESHOT) conn_unlink(reactor, conn);
+    stat_add(STAT_CLOSED, 1);
+    fprintf(stdout, "[-] Peer disconnected from server.\n");
+
+    while (conn->parked) {
+        struct request *req = conn->parked;
+        conn->parked = req->next;
+        free(req);
+    }
+    if (conn->inflight == 0) conn_release(reactor, conn);
+}
+
+
+/* After the peer's EOF the connection stays open until every reply is out. */
+void conn_finish(struct reactor *reactor, struct conn *conn) {
+    if (conn->eof && conn->inflight == 0 && conn->parked == NULL && conn->out_len == 0 && !conn->sending
+        && !conn->held) {
+        conn_close(reactor, conn);
+    }
+}
+
+
+/* Answers each line, without its line ending, with its hash in hex.
+ * Returns the length of the replies written to out.
+ */
+size_t hash_lines(const char *data, const size_t len, char *out) {
+    size_t out_len = 0;
+
+    for (const char *line = data; line < data + len;) {
+        const char *nl = memchr(line, '\n', (size_t) (data + len - line));
+        size_t line_len = (size_t) (nl - line);
+        if (line_len && line[line_len - 1] == '\r') line_len--;
+        snprintf(out + out_len, HASH_REPLY_LEN + 1, "%016llx\n", (unsigned long long) cache_hash(line, line_len));
+        out_len += HASH_REPLY_LEN;
+        line = nl + 1;
+    }
+    return out_len;
+}
+
+
+/* Runs on a pool worker: req->data goes in as lines and comes back as their hashes. */
+void process_request(struct task *task) {
+    struct request *req = container_of(task, struct request, task);
+    char reply[BUFFER_SIZE + 1];
+
+    req->len = hash_lines(req->data, req->len, reply);
+    memcpy(req->data, reply, req->len);
+}
+
+
+/* Writes a finished request, holding it back until every earlier one is out. */
+void deliver_reply(struct reactor *reactor, struct request *req) {
+    struct conn *conn = req->conn;
+
+    conn->inflight--;
+    if (conn->closed) {
+        free(req);
+        if (conn->inflight == 0) conn_release(reactor, conn);
+        return;
+    }
+
+    if (req->seq != conn->next_reply) {
+        struct request **slot = &conn->parked;
+        while (*slot && (*slot)->seq < req->seq) slot = &(*slot)->next;
+        req->next = *slot;
+        *slot = req;
+        return;
+    }
+
+    while (req) {
+        const int rc = conn_send(conn, req->data, req->len);
+        conn->next_reply++;
+        free(req);
+        if (rc) {
+            perror("conn_send");
+            conn_close(reactor, conn);
+            return;
+        }
+        req = NULL;
+        if (conn->parked && conn->parked->seq == conn->next_reply) {
+            req = conn->parked;
+            conn->parked = req->next;
+        }
+    }
+    if (conn->throttled && conn_backlog(conn) <= OUT_LOW_WATER) {
+        conn_throttle(reactor, conn, false);
+        /* Input parsed but held back waits for no new event. */
+        if (!conn->closed && conn->in_len) protocol->on_readable(reactor, conn);
+    }
+    conn_finish(reactor, conn);
+}
+
+
+/* Completions from the pool. */
+void on_wakeup(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct mpsc_node *node;
+
+    mailbox_clear(&reactor->replies);
+    while ((node = mailbox_pop(&reactor->replies))) {
+        deliver_reply(reactor, container_of(node, struct request, task.node));
+    }
+}
+
+
+/* Reads everything available; edge-triggered, so it must drain the socket. */
+void conn_read(struct reactor *reactor, struct conn *conn) {
     char buffer[BUFFER_SIZE];
+
+    while (!conn->eof) {
+        if (conn_backlog(conn) >= OUT_HIGH_WATER) {
+            conn_throttle(reactor, conn, true);
+            return;
+        }
+        const ssize_t bytes_received = read(conn->watch.fd, buffer, BUFFER_SIZE);
+        if (bytes_received > 0) {
+            /* Received a few bytes */
+            fprintf(stdout, "[*] Received: %ld bytes\n", bytes_received);
+            conn->bytes += (uint64_t) bytes_received;
+            stat_add(STAT_BYTES_IN, (uint64_t) bytes_received);
+            if (conn_send(conn, buffer, (size_t) bytes_received)) {
+                perror("conn_send");
+                conn_close(reactor, conn);
+                return;
+            }
+            continue;
+        }
+
+        if (bytes_received == 0) {
+            /* Client closed its side; finish the replies, then close. */
+            conn->eof = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("read");
+            conn_close(reactor, conn);
+        }
+        /* No more data to read. */
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+/* Echo replies with whatever arrives. */
+const struct protocol echo_protocol = {
+    .name = "echo",
+    .on_readable = conn_read,
+};
+
+
+/* Hands complete lines to the pool in batches of up to BUFFER_SIZE bytes, or
+ * hashes them right here without one. Stops at the high-water mark and
+ * leaves the rest in conn->in for when the backlog drains. Returns -1 once
+ * the connection is closed.
+ */
+int hash_answer(struct reactor *reactor, struct conn *conn) {
+    size_t used = 0;
+
+    while (true) {
+        if (conn_backlog(conn) >= OUT_HIGH_WATER) {
+            conn_throttle(reactor, conn, true);
+            break;
+        }
+        size_t batch = 0;
+        size_t lines = 0;
+        const char *nl;
+        while ((nl = memchr(conn->in + used + batch, '\n', conn->in_len - used - batch))) {
+            const size_t line_len = (size_t) (nl + 1 - (conn->in + used + batch));
+            if (batch + line_len > BUFFER_SIZE || (lines + 1) * HASH_REPLY_LEN > BUFFER_SIZE) break;
+            batch += line_len;
+            lines++;
+        }
+        if (lines == 0) break;
+
+        if (reactor->pool == NULL) {
+            char reply[BUFFER_SIZE + 1];
+            if (conn_send(conn, reply, hash_lines(conn->in + used, batch, reply))) {
+                perror("conn_send");
+                conn_close(reactor, conn);
+                return -1;
+            }
+        }
+        else {
+            struct request *req = malloc(sizeof(*req));
+            if (req == NULL) {
+                perror("malloc");
+                conn_close(reactor, conn);
+                return -1;
+            }
+            memcpy(req->data, conn->in + used, batch);
+            req->task.run = process_request;
+            req->task.reply = &reactor->replies;
+            req->conn = conn;
+            req->seq = conn->next_seq++;
+            req->len = batch;
+            conn->inflight++;
+            pool_submit(reactor->pool, &req->task);
+        }
+        used += batch;
+    }
+    conn_consume(conn, used);
+    return conn->closed ? -1 : 0;
+}
+
+
+/* Lines held back by the high-water mark go first; a throttled connection
+ * reads nothing more. A line longer than BUFFER_SIZE is an error.
+ */
+void hash_read(struct reactor *reactor, struct conn *conn) {
+    if (hash_answer(reactor, conn) || conn->throttled) return;
+    if (conn_fill(conn)) {
+        if (errno == EMSGSIZE) fprintf(stderr, "[!] Input limit reached.\n");
+        else perror("read");
+        conn_close(reactor, conn);
+        return;
+    }
+    if (hash_answer(reactor, conn)) return;
+    if (!conn->throttled && conn->in_len >= BUFFER_SIZE) {
+        fprintf(stderr, "[!] Line longer than %d bytes.\n", BUFFER_SIZE);
+        conn_close(reactor, conn);
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+/* Answers every line with its 64-bit hash; with -w the hashing runs on the pool. */
+const struct protocol hash_protocol = {
+    .name = "hash",
+    .on_readable = hash_read,
+};
+
+
+void conn_rearm(struct reactor *reactor, struct conn *conn) {
     struct epoll_event epoll_event;
-    struct epoll_event epoll_events_queue[MAX_EVENTS];
 
-    /* no buffering for printf */
-    setvbuf(stdout, NULL, _IONBF, 0);
-    setvbuf(stderr, NULL, _IONBF, 0);
+    epoll_event.data.ptr = &conn->watch;
+    epoll_event.events = oneshot_events(conn);
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->watch.fd, &epoll_event)) {
+        perror("epoll_ctl");
+        conn_close(reactor, conn);
+    }
+}
+
+
+void on_conn_event(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct conn *conn = container_of(watch, struct conn, watch);
+
+    /* A hang-up with input left is read to its EOF first. */
+    if (events & EPOLLERR || (events & EPOLLHUP && !(events & EPOLLIN))) {
+        conn_close(reactor, conn);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        if (conn_flush(conn)) {
+            perror("conn_flush");
+            conn_close(reactor, conn);
+            return;
+        }
+        if (conn->throttled && conn_backlog(conn) <= OUT_LOW_WATER) {
+            conn_throttle(reactor, conn, false);
+            if (conn->closed) return;
+            /* Input may have been waiting all along. */
+            events |= EPOLLIN;
+        }
+        conn_finish(reactor, conn);
+        if (conn->closed) return;
+        if (protocol->on_writable && conn->out_len == 0) protocol->on_writable(reactor, conn);
+        if (conn->closed) return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        if (conn_backlog(conn) >= OUT_HIGH_WATER) conn_throttle(reactor, conn, true);
+        else protocol->on_readable(reactor, conn);
+    }
+
+    /* Last touch: once re-armed, another thread may already be handling it. */
+    if (dispatch == DISPATCH_ONESHOT && !conn->closed) conn_rearm(reactor, conn);
+}
+
+
+/* Coroutine side of read(): suspends until epoll reports the socket readable.
+ * Returns 0 at EOF, -1 on error.
+ */
+ssize_t co_read(struct conn *conn, void *buf, const size_t len) {
+    while (true) {
+        const ssize_t bytes_received = read(conn->watch.fd, buf, len);
+        if (bytes_received >= 0) {
+            conn->bytes += (uint64_t) bytes_received;
+            stat_add(STAT_BYTES_IN, (uint64_t) bytes_received);
+            return bytes_received;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        conn->waiting = EPOLLIN;
+        coro_yield(conn->co);
+    }
+}
+
+
+/* Coroutine side of send_all(): suspends whenever the socket is full.
+ * Returns 0 once everything is written, -1 on error.
+ */
+int co_write(struct conn *conn, const void *msg, const size_t len) {
+    const char *data = msg;
+    size_t total_sent = 0;
+
+    while (true) {
+        const ssize_t bytes_sent = send_some(conn->watch.fd, data + total_sent, len - total_sent);
+        if (bytes_sent < 0) return -1;
+        total_sent += (size_t) bytes_sent;
+        stat_add(STAT_BYTES_OUT, (uint64_t) bytes_sent);
+        if (total_sent == len) return 0;
+        conn->waiting = EPOLLOUT;
+        coro_yield(conn->co);
+    }
+}
+
+
+/* The echo handler written as straight-line code. */
+void co_echo(struct coro *co, void *arg) {
+    struct conn *conn = arg;
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_received;
+
+    while ((bytes_received = co_read(conn, buffer, BUFFER_SIZE)) > 0) {
+        fprintf(stdout, "[*] Received: %ld bytes\n", bytes_received);
+        if (co_write(conn, buffer, (size_t) bytes_received)) {
+            perror("co_write");
+            break;
+        }
+    }
+}
+
+
+/* Resumes the handler when the event it waits for arrives; it runs until it
+ * blocks again. A handler that returns is done with the connection.
+ */
+void on_coro_event(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    struct conn *conn = container_of(watch, struct conn, watch);
+
+    /* A hang-up with input left is read to its EOF first, as in on_conn_event(). */
+    if (events & EPOLLERR || (events & EPOLLHUP && !(events & EPOLLIN))) {
+        conn_close(reactor, conn);
+        return;
+    }
+    if (events & (conn->waiting | EPOLLRDHUP | EPOLLHUP)) {
+        coro_resume(conn->co);
+        if (coro_done(conn->co)) {
+            conn_close(reactor, conn);
+            return;
+        }
+    }
+
+    /* Last touch: once re-armed, another thread may already be handling it. */
+    if (dispatch == DISPATCH_ONESHOT) conn_rearm(reactor, conn);
+}
+
+
+/* Registers a connection with this reactor's epoll set. */
+int conn_attach(struct reactor *reactor, struct conn *conn) {
+    struct epoll_event epoll_event;
+
+    epoll_event.data.ptr = &conn->watch;
+    epoll_event.events = conn_events(conn);
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->watch.fd, &epoll_event)) {
+        return -1;
+    }
+    /* Shared connections belong to no reactor in particular. */
+    if (dispatch != DISPATCH_ONESHOT) conn_link(reactor, conn);
+    return 0;
+}
+
+
+/* Sets up a freshly accepted, already non-blocking socket. */
+void conn_accepted(struct reactor *reactor, const int peer_fd) {
+    struct conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        perror("calloc");
+        close(peer_fd);
+        return;
+    }
+    conn->watch.fd = peer_fd;
+    conn->watch.on_event = on_conn_event;
+    if (coroutines) {
+        conn->co = coro_create(co_echo, conn);
+        if (conn->co == NULL) {
+            perror("coro_create");
+            close(peer_fd);
+            conn_free(conn);
+            return;
+        }
+        conn->watch.on_event = on_coro_event;
+        conn->waiting = EPOLLIN;
+    }
+
+    /* Before epoll can hand the connection to another thread. */
+    if (protocol->on_open && protocol->on_open(reactor, conn)) {
+        perror("on_open");
+        close(peer_fd);
+        conn_free(conn);
+        return;
+    }
+    if (conn_attach(reactor, conn)) {
+        perror("epoll_ctl");
+        if (protocol->on_close) protocol->on_close(reactor, conn);
+        close(peer_fd);
+        conn_free(conn);
+        return;
+    }
+    stat_add(STAT_ACCEPTED, 1);
+    fprintf(stdout, "[*] New Connection\n");
+}
+
+
+/* New incoming connections. Takes all of them: an exclusive wakeup goes to
+ * one reactor only, and nothing else would come for the rest of the backlog.
+ */
+void on_accept(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    while (true) {
+        const int peer_fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (peer_fd != -1) {
+            conn_accepted(reactor, peer_fd);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+        return;
+    }
+}
+
+
+/* Queues msg for reactor `core` without taking a lock: every ordered pair of
+ * reactors has its own SPSC channel. Delivery happens on the target's thread;
+ * its doorbell is rung once, by flush_outboxes() at the end of this iteration.
+ */
+void reactor_submit(struct reactor *from, const unsigned core, struct message *msg) {
+    struct outbox *out = &from->outboxes[core];
+
+    if (out->head == NULL && spsc_push(&reactors[core].channels[from->index], msg)) {
+        out->dirty = true;
+        return;
+    }
+    msg->next = NULL;
+    if (out->head) out->tail->next = msg;
+    else {
+        out->head = msg;
+        from->backlogged++;
+    }
+    out->tail = msg;
+}
+
+
+/* Moves backlogged messages into the channels and wakes each target once. */
+void flush_outboxes(struct reactor *reactor) {
+    for (unsigned core = 0; core < reactor_count; ++core) {
+        struct outbox *out = &reactor->outboxes[core];
+        struct spsc_ring *channel = &reactors[core].channels[reactor->index];
+
+        while (out->head && spsc_push(channel, out->head)) {
+            out->head = out->head->next;
+            out->dirty = true;
+            if (out->head == NULL) reactor->backlogged--;
+        }
+        if (out->dirty) {
+            out->dirty = false;
+            doorbell_ring(&reactors[core].doorbell);
+        }
+    }
+}
+
+
+/* Drains every incoming channel. */
+void on_messages(struct reactor *reactor, struct watch *watch, uint32_t events) {
+    doorbell_clear(&reactor->doorbell);
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        struct message *msg;
+        while ((msg = spsc_pop(&reactor->channels[i]))) msg->deliver(reactor, msg);
+    }
+}
+
+
+/* A connection arriving from another reactor. Adding it to epoll reports any
+ * readiness that built up while it was in flight.
+ */
+void adopt_conn(struct reactor *reactor, struct message *msg) {
+    struct conn *conn = container_of(msg, struct conn, migrate);
+
+    if (conn_attach(reactor, conn)) {
+        perror("epoll_ctl");
+        close(conn->watch.fd);
+        conn_free(conn);
+        return;
+    }
+    stat_add(STAT_MIGRATED_IN, 1);
+}
+
+
+/* Hands a connection to another reactor. Only idle connections move: a request
+ * still in the pool would come back to this reactor's mailbox.
+ */
+void conn_migrate(struct reactor *from, struct conn *conn, struct reactor *to) {
+    epoll_ctl(from->epoll_fd, EPOLL_CTL_DEL, conn->watch.fd, NULL);
+    conn_unlink(from, conn);
+    stat_add(STAT_MIGRATED_OUT, 1);
+    conn->migrate.deliver = adopt_conn;
+    reactor_submit(from, to->index, &conn->migrate);
+}
+
+
+int compare_rate(const void *a, const void *b) {
+    const uint64_t ra = (*(struct conn *const *) a)->rate;
+    const uint64_t rb = (*(struct conn *const *) b)->rate;
+    return (ra < rb) - (ra > rb);
+}
+
+
+/* Moves the busiest connections that fit in the budget to `to`. A connection
+ * bigger than the whole budget stays: moving it would only move the hot spot.
+ * So does one with a coroutine, whose stack belongs to this thread's pool.
+ */
+void shed_load(struct reactor *reactor, struct reactor *to, uint64_t budget) {
+    size_t count = 0;
+
+    for (struct conn *conn = reactor->conns; conn; conn = conn->next) count++;
+    struct conn **candidates = malloc(count * sizeof(*candidates));
+    if (candidates == NULL) return;
+
+    count = 0;
+    for (struct conn *conn = reactor->conns; conn; conn = conn->next) {
+        if (conn->rate && !conn->eof && conn->inflight == 0 && conn->parked == NULL && !conn->sending && !conn->held
+            && !conn->pinned && conn->co == NULL) {
+            candidates[count++] = conn;
+        }
+    }
+    qsort(candidates, count, sizeof(*candidates), compare_rate);
+
+    for (size_t i = 0; i < count && budget; ++i) {
+        if (candidates[i]->rate > budget) continue;
+        budget -= candidates[i]->rate;
+        conn_migrate(reactor, candidates[i], to);
+    }
+    free(candidates);
+}
+
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+
+uint64_t now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+
+/* Adds up every reactor's block and prints it, plus one line per reactor. */
+void report_stats(void) {
+    struct stats_total total;
+    char label[32];
+
+    if (reactor_count > 1) {
+        for (unsigned i = 0; i < reactor_count; ++i) {
+            snprintf(label, sizeof(label), "Reactor %u", i);
+            stats_sum(reactors[i].stats, 1, &total);
+            stats_print(stderr, label, &total);
+        }
+    }
+    stats_sum(reactors[0].stats, reactor_count, &total);
+    stats_print(stderr, "Total", &total);
+}
+
+
+/* Once per TICK_MS: turn byte counts into rates, publish the reactor's load
+ * and act on a pending request from the balancer.
+ */
+void reactor_tick(struct reactor *reactor, const uint64_t now) {
+    const uint64_t elapsed = now - reactor->next_tick + TICK_MS;
+    uint64_t load = 0;
+
+    for (struct conn *conn = reactor->conns; conn; conn = conn->next) {
+        conn->rate = conn->bytes * 1000 / elapsed;
+        conn->bytes = 0;
+        load += conn->rate;
+    }
+    atomic_store(&reactor->load, load);
+    reactor->next_tick = now + TICK_MS;
+
+    const int target = atomic_exchange(&reactor->migrate_to, -1);
+    if (target >= 0) {
+        shed_load(reactor, &reactors[target], atomic_load(&reactor->migrate_budget));
+    }
+
+    if (protocol->on_tick) protocol->on_tick(reactor);
+
+    if (reactor->index == 0 && report_requested) {
+        report_requested = 0;
+        report_stats();
+    }
+}
+
+
+/* Runs in the main thread: asks the busiest reactor to move half the gap to
+ * the idlest one when they differ by more than a quarter.
+ */
+void balance(void) {
+    unsigned busiest = 0, idlest = 0;
+    uint64_t high = 0, low = UINT64_MAX;
+
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        const uint64_t load = atomic_load(&reactors[i].load);
+        if (load > high) {
+            high = load;
+            busiest = i;
+        }
+        if (load < low) {
+            low = load;
+            idlest = i;
+        }
+    }
+    if (busiest == idlest || high * 4 <= low * 5) return;
+
+    atomic_store(&reactors[busiest].migrate_budget, (high - low) / 2);
+    atomic_store(&reactors[busiest].migrate_to, (int) idlest);
+}
+
+
+/* Creates, binds and starts a non-blocking listening socket. */
+int open_listener(const bool reuseport) {
+    struct sockaddr_in server_addr;
 
     /* Creating a listening socket. */
-    const int LISTEN_FD = socket(AF_INET, SOCK_STREAM, 0);
-    if (LISTEN_FD == -1) {
+    const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
         perror("socket");
         exit(1);
     }
 
     /* Allow reuse of address. */
-    if (setsockopt(LISTEN_FD, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
         perror("setsockopt");
         exit(3);
     }
 
+    /* One listener per reactor; the kernel spreads connections between them. */
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1) {
+        perror("setsockopt");
+        exit(4);
+    }
+
     /* Bind to specified port. */
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(PORT);
     server_addr.sin_addr.s_addr = INADDR_ANY;
     memset(&(server_addr.sin_zero), '\0', 8);
 
-    if (bind(LISTEN_FD, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
+    if (bind(listen_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
         perror("bind");
         exit(5);
     }
 
     /* Start listening. */
-    if (listen(LISTEN_FD, SOMAXCONN) == -1) {
+    if (listen(listen_fd, SOMAXCONN) == -1) {
         perror("listen");
         exit(6);
     }
 
     /* Set listening socket to non-blocking. */
-    if (set_nonblock(LISTEN_FD) == -1) {
+    if (set_nonblock(listen_fd) == -1) {
         perror("set_nonblock");
         exit(7);
     }
+    return listen_fd;
+}
+
+
+/* Steers each connection to the listener of the reactor pinned to the CPU that
+ * took the SYN, so the connection lives on one core from accept to close.
+ * The group indexes listeners in listen() order, i.e. by reactor; with fewer
+ * reactors than CPUs the CPU number wraps around.
+ * The locality this buys over plain reuseport is unmeasured: it needs several
+ * cores and pinned client threads. On one CPU every connection goes to
+ * reactor 0, which only shows that the program picks as intended.
+ */
+void attach_cpu_steering(const int listen_fd) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, reactor_count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    const struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        perror("setsockopt");
+        exit(4);
+    }
+}
+
+
+/* Adds a watch for `fd` to the reactor's epoll set. */
+void reactor_watch(struct reactor *reactor, struct watch *watch, const int fd, const uint32_t events,
+                   void (*on_event)(struct reactor *, struct watch *, uint32_t)) {
+    struct epoll_event epoll_event;
+
+    watch->fd = fd;
+    watch->on_event = on_event;
+    epoll_event.events = events;
+    epoll_event.data.ptr = watch;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) == -1) {
+        perror("epoll_ctl");
+        exit(9);
+    }
+}
+
+
+void reactor_init(struct reactor *reactor, const unsigned index, const int listen_fd, struct pool *pool,
+                  struct stats_block *stats) {
+    reactor->index = index;
+    reactor->pool = pool;
+    reactor->stats = stats;
+    atomic_init(&reactor->load, 0);
+    atomic_init(&reactor->migrate_to, -1);
+    atomic_init(&reactor->migrate_budget, 0);
 
     /* Create an epoll instance. */
-    const int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->epoll_fd == -1) {
         perror("epoll_create1");
         exit(8);
     }
 
-    /* Register listening socket to epoll. */
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.fd = LISTEN_FD;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, LISTEN_FD, &epoll_event) == -1) {
-        perror("epoll_ctl");
-        exit(9);
+    /* Register listening socket to epoll. A shared listener is exclusive so a
+     * connection wakes one thread instead of every one in epoll_wait(). */
+    const bool shared = dispatch == DISPATCH_EXCLUSIVE || dispatch == DISPATCH_ONESHOT;
+    reactor_watch(reactor, &reactor->listener, listen_fd, shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN, on_accept);
+
+    /* Eventfds for pool completions and for messages from other reactors. */
+    if (mailbox_init(&reactor->replies) == -1 || doorbell_init(&reactor->doorbell) == -1) {
+        perror("eventfd");
+        exit(10);
     }
+    reactor_watch(reactor, &reactor->wakeup, reactor->replies.bell.event_fd, EPOLLIN, on_wakeup);
+    reactor_watch(reactor, &reactor->messages, reactor->doorbell.event_fd, EPOLLIN, on_messages);
 
-    /* Set up signal handling. */
-    signal(SIGINT, handle_sigint);
+    /* A channel from every reactor, this one included. Shared-epoll threads
+     * cannot be addressed, so oneshot mode has none. */
+    if (dispatch == DISPATCH_ONESHOT) return;
+    reactor->channels = calloc(reactor_count, sizeof(*reactor->channels));
+    reactor->outboxes = calloc(reactor_count, sizeof(*reactor->outboxes));
+    if (reactor->channels == NULL || reactor->outboxes == NULL) {
+        perror("calloc");
+        exit(2);
+    }
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        if (spsc_init(&reactor->channels[i], CHANNEL_SIZE) == -1) {
+            perror("spsc_init");
+            exit(2);
+        }
+    }
+}
 
-    /* Main loop */
-    fprintf(stderr,"[*] Server is running.\n");
+
+/* Oneshot mode: the thread waits on the first reactor's epoll set. It has no
+ * mailbox or channels, as their consumer must be a single thread.
+ */
+void reactor_share(struct reactor *reactor, const unsigned index, const struct reactor *first,
+                   struct stats_block *stats) {
+    reactor->index = index;
+    reactor->stats = stats;
+    reactor->epoll_fd = first->epoll_fd;
+    atomic_init(&reactor->load, 0);
+    atomic_init(&reactor->migrate_to, -1);
+    atomic_init(&reactor->migrate_budget, 0);
+}
+
+
+void *reactor_run(void *arg) {
+    struct reactor *reactor = arg;
+    struct epoll_event epoll_events_queue[MAX_EVENTS];
+
+    thread_stats = reactor->stats;
+    reactor->next_tick = now_ms() + TICK_MS;
     while (keep_running) {
-        const int fds_ready = epoll_wait(epoll_fd, epoll_events_queue, MAX_EVENTS, 1000);
+        /* Come back soon if a full channel is holding messages back. */
+        const int timeout = reactor->backlogged ? 1 : TICK_MS;
+        const int fds_ready = epoll_wait(reactor->epoll_fd, epoll_events_queue, MAX_EVENTS, timeout);
         if (fds_ready == -1) {
             /* Interrupted by a signal. */
             if (errno == EINTR) continue;
             perror("epoll_wait");
             break;
         }
+        const uint64_t start = now_ns();
         for (int i = 0; i < fds_ready; ++i) {
-            if (epoll_events_queue[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-                /* Client closed connection. */
-                close_socket(epoll_events_queue[i].data.fd, epoll_fd);
-                fprintf(stdout, "[-] Peer disconnected from server.\n");
-                continue;
-            }
-            /* New incoming connection. */
-            if (epoll_events_queue[i].data.fd == LISTEN_FD) {
-                const int peer_fd = accept(LISTEN_FD, (struct sockaddr *) &peer_addr, &addr_len);
-                if (peer_fd == -1) {
-                    perror("accept");
-                    continue;
-                }
+            struct watch *watch = epoll_events_queue[i].data.ptr;
+            watch->on_event(reactor, watch, epoll_events_queue[i].events);
+        }
+        if (fds_ready && protocol->on_batch) protocol->on_batch(reactor);
+        reap_conns(reactor);
 
-                set_nonblock(peer_fd);
-                epoll_event.data.fd = peer_fd;
-                epoll_event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+        /* How long the ready connections held up the rest of the loop. */
+        const uint64_t end = now_ns();
+        if (fds_ready) stat_record(end - start);
 
-                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peer_fd, &epoll_event)) {
-                    perror("epoll_ctl");
-                }
-                fprintf(stdout, "[*] New Connection\n");
+        const uint64_t now = end / 1000000;
+        if (now >= reactor->next_tick) reactor_tick(reactor, now);
+
+        /* Batched delivery: one doorbell per target per iteration. */
+        if (reactor->outboxes) flush_outboxes(reactor);
+    }
+    return NULL;
+}
+
+
+/* Keeps reactor i on core i, so its connections stay in one core's caches. */
+void pin_to_cpu(const pthread_t thread, const unsigned index) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    if (cpus <= 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(index % (unsigned) cpus, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+
+const struct protocol *const protocols[] = {
+    &echo_protocol,
+    &hash_protocol,
+    &resp_protocol,
+    &memcache_protocol,
+    &http_protocol,
+    &discard_protocol,
+    &chargen_protocol,
+    &file_protocol,
+    &proxy_protocol,
+    &pubsub_protocol,
+};
+
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-w workers] [-t threads] [-b] [-d reuseport|exclusive|cpu|oneshot] [-P processes] [-c]\n"
+                    "       [-m echo|hash|resp|memcache|http|discard|chargen|file|proxy|pubsub] [-M megabytes] [-r root]\n"
+                    "       [-u ip:port[,ip:port...]] [-l rr|leastconn|hash] [-W warm] [-S drop|close]\n"
+                    "       [-J journal-dir]\n", name);
+    exit(1);
+}
+
+
+/* Runs the reactors of this process until SIGINT, counting into stats, one
+ * block per reactor. A listener inherited from the prefork master is shared,
+ * so it is used as with -d exclusive.
+ */
+void serve(const unsigned workers, const bool balancing, int shared_fd, struct stats_block *stats) {
+    struct pool *pool = NULL;
+
+    /* Worker pool shared by all reactors. */
+    if (workers) {
+        pool = pool_create(workers);
+        if (pool == NULL) {
+            perror("pool_create");
+            exit(11);
+        }
+    }
+
+    reactors = calloc(reactor_count, sizeof(*reactors));
+    if (reactors == NULL) {
+        perror("calloc");
+        exit(2);
+    }
+    if (shared_fd != -1 && dispatch != DISPATCH_ONESHOT) dispatch = DISPATCH_EXCLUSIVE;
+    if (shared_fd == -1 && (dispatch == DISPATCH_EXCLUSIVE || dispatch == DISPATCH_ONESHOT)) {
+        shared_fd = open_listener(false);
+    }
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        if (dispatch == DISPATCH_ONESHOT && i > 0) {
+            reactor_share(&reactors[i], i, &reactors[0], &stats[i]);
+            continue;
+        }
+        const int listen_fd = shared_fd != -1 ? shared_fd : open_listener(reactor_count > 1);
+        reactor_init(&reactors[i], i, listen_fd, pool, &stats[i]);
+    }
+    if (dispatch == DISPATCH_CPU && reactor_count > 1) attach_cpu_steering(reactors[0].listener.fd);
+
+    if (reactor_count == 1) {
+        reactor_run(&reactors[0]);
+    }
+    else {
+        for (unsigned i = 0; i < reactor_count; ++i) {
+            if (pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]) != 0) {
+                perror("pthread_create");
+                exit(12);
             }
-            else {
-                while (true) {
-                    const ssize_t bytes_received = read(epoll_events_queue[i].data.fd, buffer, BUFFER_SIZE);
-                    if (bytes_received > 0) {
-                        /* Received a few bytes */
-                        if (send_all(epoll_events_queue[i].data.fd, buffer, bytes_received)) {
-                            perror("send_all");
-                        }
-                        fprintf(stdout, "[*] Received: %ld bytes\n", bytes_received);
-                    }
-                    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        /* No more data to read. */
-                        break;
-                    }else if (bytes_received == 0) {
-                        /* Client closed connection. */
-                        close_socket(epoll_events_queue[i].data.fd, epoll_fd);
-                        fprintf(stdout, "[-] Peer disconnected from server.\n");
-                        break;
-                    }else {
-                        perror("read");
-                    }
+            pin_to_cpu(reactors[i].thread, i);
+        }
+        while (keep_running) {
+            usleep(BALANCE_INTERVAL_MS * 1000);
+            if (balancing) balance();
+        }
+        for (unsigned i = 0; i < reactor_count; ++i) {
+            pthread_join(reactors[i].thread, NULL);
+        }
+    }
+
+    pool_destroy(pool);
+    if (!prefork_worker) report_stats();
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        if (dispatch != DISPATCH_ONESHOT || i == 0) close(reactors[i].epoll_fd);
+        if (shared_fd == -1) close(reactors[i].listener.fd);
+        for (unsigned j = 0; reactors[i].channels && j < reactor_count; ++j) {
+            spsc_free(&reactors[i].channels[j]);
+        }
+        free(reactors[i].channels);
+        free(reactors[i].outboxes);
+        cache_destroy(reactors[i].cache);
+        files_destroy(reactors[i].files);
+        upstreams_destroy(reactors[i].upstreams);
+        topic_tree_destroy(reactors[i].topics);
+    }
+    if (shared_fd != -1) close(shared_fd);
+    free(reactors);
+}
+
+
+/* Forks worker i. The child serves until SIGINT and exits. */
+pid_t spawn_worker(const unsigned i, const unsigned workers, const bool balancing, const int listen_fd,
+                   struct stats_block *stats) {
+    const pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        prefork_worker = true;
+        serve(workers, balancing, listen_fd, &stats[i * reactor_count]);
+        exit(0);
+    }
+    return pid;
+}
+
+
+/* Prefork master: owns the listener, keeps `processes` workers alive and adds
+ * up their counters, which live in memory shared with the workers. A crash
+ * takes down one worker's connections, not all of them.
+ */
+void supervise(const unsigned processes, const unsigned workers, const bool balancing) {
+    const unsigned blocks = processes * reactor_count;
+    struct stats_block *stats = stats_alloc(blocks, true);
+    pid_t *pids = calloc(processes, sizeof(*pids));
+    unsigned *restarts = calloc(processes, sizeof(*restarts));
+    struct stats_total total;
+    char label[32];
+
+    if (stats == NULL || pids == NULL || restarts == NULL) {
+        perror("supervise");
+        exit(13);
+    }
+    const int listen_fd = open_listener(false);
+
+    for (unsigned i = 0; i < processes; ++i) pids[i] = spawn_worker(i, workers, balancing, listen_fd, stats);
+
+    while (keep_running) {
+        if (report_requested) {
+            report_requested = 0;
+            stats_sum(stats, blocks, &total);
+            stats_print(stderr, "Total", &total);
+        }
+
+        int status;
+        const pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0) {
+            usleep(SUPERVISE_INTERVAL_MS * 1000);
+            continue;
+        }
+        for (unsigned i = 0; i < processes; ++i) {
+            if (pids[i] != pid) continue;
+            fprintf(stderr, "[-] Worker %u (pid %d) exited, restarting.\n", i, (int) pid);
+            restarts[i]++;
+            pids[i] = keep_running ? spawn_worker(i, workers, balancing, listen_fd, stats) : 0;
+        }
+    }
+
+    for (unsigned i = 0; i < processes; ++i) {
+        if (pids[i] > 0) kill(pids[i], SIGINT);
+    }
+    while (waitpid(-1, NULL, 0) > 0) {
+    }
+    close(listen_fd);
+
+    for (unsigned i = 0; i < processes; ++i) {
+        snprintf(label, sizeof(label), "Worker %u (%u restarts)", i, restarts[i]);
+        stats_sum(&stats[i * reactor_count], reactor_count, &total);
+        stats_print(stderr, label, &total);
+    }
+    stats_sum(stats, blocks, &total);
+    stats_print(stderr, "Total", &total);
+
+    stats_free(stats, blocks);
+    free(restarts);
+    free(pids);
+}
+
+
+int main(const int argc, char *argv[]) {
+    unsigned workers = 0;
+    unsigned processes = 0;
+    bool balancing = false;
+    const char *upstream = NULL;
+    const char *journal_dir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:t:bd:P:cm:M:r:u:l:W:S:J:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = (unsigned) atoi(optarg);
+                break;
+            case 't':
+                reactor_count = (unsigned) atoi(optarg);
+                break;
+            case 'b':
+                balancing = true;
+                break;
+            case 'd':
+                if (strcmp(optarg, "reuseport") == 0) dispatch = DISPATCH_REUSEPORT;
+                else if (strcmp(optarg, "exclusive") == 0) dispatch = DISPATCH_EXCLUSIVE;
+                else if (strcmp(optarg, "cpu") == 0) dispatch = DISPATCH_CPU;
+                else if (strcmp(optarg, "oneshot") == 0) dispatch = DISPATCH_ONESHOT;
+                else usage(argv[0]);
+                break;
+            case 'P':
+                processes = (unsigned) atoi(optarg);
+                break;
+            case 'c':
+                coroutines = true;
+                break;
+            case 'm':
+                protocol = NULL;
+                for (size_t i = 0; i < sizeof(protocols) / sizeof(protocols[0]); ++i) {
+                    if (strcmp(optarg, protocols[i]->name) == 0) protocol = protocols[i];
                 }
-            }
+                if (protocol == NULL) usage(argv[0]);
+                break;
+            case 'M':
+                cache_limit = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+            case 'r':
+                file_root = optarg;
+                break;
+            case 'u':
+                upstream = optarg;
+                break;
+            case 'l':
+                if (proxy_set_policy(optarg)) usage(argv[0]);
+                break;
+            case 'W':
+                proxy_prewarm = (unsigned) atoi(optarg);
+                break;
+            case 'S':
+                if (strcmp(optarg, "drop") == 0) pubsub_close_slow = false;
+                else if (strcmp(optarg, "close") == 0) pubsub_close_slow = true;
+                else usage(argv[0]);
+                break;
+            case 'J':
+                journal_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
         }
     }
+    if (reactor_count == 0) reactor_count = 1;
+    if (dispatch == DISPATCH_ONESHOT && workers) {
+        /* A reply could come back to one thread while another handles the connection. */
+        fprintf(stderr, "-w cannot be combined with -d oneshot.\n");
+        exit(1);
+    }
+    if (coroutines && dispatch == DISPATCH_ONESHOT) {
+        /* A coroutine's stack belongs to the thread that made it; any thread could resume it here. */
+        fprintf(stderr, "-c cannot be combined with -d oneshot.\n");
+        exit(1);
+    }
+    if (coroutines && workers) {
+        /* Coroutine handlers do their work where they run. */
+        fprintf(stderr, "-w cannot be combined with -c.\n");
+        exit(1);
+    }
+    if (coroutines && protocol != &echo_protocol) {
+        fprintf(stderr, "-c only applies to -m echo.\n");
+        exit(1);
+    }
+    if (workers && protocol != &hash_protocol) {
+        /* Echo has nothing to compute: a trip through the pool would only add latency. */
+        fprintf(stderr, "-w only applies to -m hash.\n");
+        exit(1);
+    }
+    if (dispatch == DISPATCH_ONESHOT && (protocol == &memcache_protocol || protocol == &file_protocol
+                                         || protocol == &proxy_protocol || protocol == &pubsub_protocol)) {
+        /* A shard, a file cache, an upstream socket or a topic table belongs
+         * to one reactor; shared-epoll threads would all reach into it.
+         */
+        fprintf(stderr, "-m %s cannot be combined with -d oneshot.\n", protocol->name);
+        exit(1);
+    }
+    if (protocol == &proxy_protocol && (upstream == NULL || proxy_set_upstream(upstream))) {
+        fprintf(stderr, "-m proxy needs -u ip:port[,ip:port...].\n");
+        exit(1);
+    }
+    if (journal_dir && (protocol != &resp_protocol || processes || dispatch == DISPATCH_ONESHOT)) {
+        /* One store, one journal, and replies held back by the thread that owns the connection. */
+        fprintf(stderr, "-J needs -m resp in a single process, without -d oneshot.\n");
+        exit(1);
+    }
+    if (journal_dir && resp_journal_open(journal_dir)) {
+        perror("journal_open");
+        exit(16);
+    }
 
-    close(epoll_fd);
-    close(LISTEN_FD);
+    /* no buffering for printf */
+    setvbuf(stdout, NULL, _IONBF, 0);
+    setvbuf(stderr, NULL, _IONBF, 0);
+
+    /* Set up signal handling. */
+    signal(SIGINT, handle_sigint);
+    signal(SIGUSR1, handle_sigusr1);
+    /* A peer that hangs up mid-write is an EPIPE on that connection, not the end of the server. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Main loop */
+    fprintf(stderr,"[*] Server is running.\n");
+    if (processes) {
+        supervise(processes, workers, balancing);
+    }
+    else {
+        struct stats_block *stats = stats_alloc(reactor_count, false);
+        if (stats == NULL) {
+            perror("stats_alloc");
+            exit(13);
+        }
+        serve(workers, balancing, -1, stats);
+        stats_free(stats, reactor_count);
+    }
+    journal_close();
 
     fprintf(stderr,"[*] Server closed.\n");
     return 0;
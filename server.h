@@ -0,0 +1,178 @@
+/**
+ * @file server.h
+ *
+ * @brief Reactor and connection types shared by the server's protocol modes.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pool.h"
+#include "stats.h"
+
+#define BUFFER_SIZE 1024
+
+struct reactor;
+struct conn;
+
+/* Work for another reactor's thread. Embed it in the object it concerns and
+ * recover the object with container_of() in deliver().
+ */
+struct message {
+    struct message *next;       /* sender's backlog while the channel is full */
+    void (*deliver)(struct reactor *reactor, struct message *msg);
+};
+
+/* Sender side of the channel to one other reactor. */
+struct outbox {
+    struct message *head;       /* did not fit into the channel yet */
+    struct message *tail;
+    bool dirty;                 /* pushed this iteration, doorbell not rung yet */
+};
+
+/* Anything registered with epoll; the event's data.ptr points at one of these. */
+struct watch {
+    int fd;
+    void (*on_event)(struct reactor *reactor, struct watch *watch, uint32_t events);
+};
+
+/* One event loop. With -t there is one per thread, each pinned to a core
+ * with its own SO_REUSEPORT listener.
+ */
+struct reactor {
+    int epoll_fd;
+    unsigned index;
+    pthread_t thread;
+    struct watch listener;
+    struct watch wakeup;
+    struct mailbox replies;     /* requests coming back from the pool */
+    struct watch messages;
+    struct doorbell doorbell;   /* rung once per sender iteration with messages */
+    struct spsc_ring *channels; /* channels[i]: messages from reactor i */
+    struct outbox *outboxes;    /* outboxes[i]: messages to reactor i */
+    unsigned backlogged;        /* outboxes with messages waiting for room */
+    struct pool *pool;          /* NULL: requests are handled inline */
+    struct conn *conns;         /* every open connection */
+    struct conn *dead;          /* freed once the current epoll batch is done */
+    uint64_t next_tick;
+    struct stats_block *stats;  /* this thread's counters */
+    struct cache *cache;        /* this reactor's shard, with -m memcache */
+    struct file_cache *files;   /* open files, with -m file */
+    struct upstream_pool *upstreams;    /* warm backend connections, with -m proxy -W */
+    struct topic_tree *topics;  /* local subscribers, with -m pubsub */
+
+    /* Shared with the balancer. */
+    atomic_uint_fast64_t load;              /* bytes/s read over the last tick */
+    atomic_int migrate_to;                  /* -1 unless asked to shed load */
+    atomic_uint_fast64_t migrate_budget;    /* bytes/s worth of connections to move */
+};
+
+/* Per-connection state. */
+struct conn {
+    struct watch watch;
+    struct conn *prev;          /* the owning reactor's list */
+    struct conn *next;
+    struct message migrate;
+    uint64_t bytes;             /* read since the last tick */
+    uint64_t rate;              /* bytes/s over the last tick */
+    char *in;                   /* received, not yet parsed (buffered protocols) */
+    size_t in_len;
+    size_t in_size;
+    char *out;                  /* bytes the socket did not take yet */
+    size_t out_len;
+    size_t out_size;
+    uint64_t next_seq;          /* sequence number of the next request */
+    uint64_t next_reply;        /* sequence number of the next reply to write */
+    struct request *parked;     /* replies that finished early, sorted by seq */
+    unsigned inflight;          /* requests out in the pool or at another reactor */
+    struct coro *co;            /* handler coroutine, with -c */
+    uint32_t waiting;           /* event the coroutine is suspended on */
+    struct conn *next_dead;
+    void *session;              /* the protocol's own state, freed in on_close() or else with the conn */
+    bool eof;                   /* no more input: peer's EOF or a protocol error */
+    bool sending;               /* the protocol is still writing a reply from on_writable() */
+    bool held;                  /* replies wait for the journal commit */
+    bool pinned;                /* holds other descriptors in this reactor: never migrated */
+    bool throttled;             /* output past the high-water mark: no input until it drains */
+    bool closed;
+};
+
+/* What the server speaks on client connections, chosen with -m. */
+struct protocol {
+    const char *name;
+    int (*on_open)(struct reactor *reactor, struct conn *conn);         /* may be NULL; -1 refuses */
+    void (*on_readable)(struct reactor *reactor, struct conn *conn);
+    void (*on_writable)(struct reactor *reactor, struct conn *conn);       /* may be NULL */
+    void (*on_close)(struct reactor *reactor, struct conn *conn);       /* may be NULL */
+    void (*on_tick)(struct reactor *reactor);                           /* may be NULL; once a tick */
+    void (*on_batch)(struct reactor *reactor);                          /* may be NULL; after each epoll batch */
+};
+
+extern const struct protocol echo_protocol;
+extern const struct protocol hash_protocol;
+extern const struct protocol resp_protocol;
+extern const struct protocol memcache_protocol;
+extern const struct protocol http_protocol;
+extern const struct protocol discard_protocol;
+extern const struct protocol chargen_protocol;
+extern const struct protocol file_protocol;
+extern const struct protocol proxy_protocol;
+extern const struct protocol pubsub_protocol;
+
+extern struct reactor *reactors;
+extern unsigned reactor_count;
+extern size_t cache_limit;      /* -M: item memory of all shards together */
+extern const char *file_root;   /* -r: what -m file serves */
+extern unsigned proxy_prewarm;  /* -W: idle connections per backend and reactor */
+extern bool pubsub_close_slow;  /* -S close: a full subscriber queue closes it rather than dropping */
+
+/* Reads everything available into conn->in. Returns -1 on error; EOF sets conn->eof. */
+int conn_fill(struct conn *conn);
+
+/* Drops the first `used` bytes of conn->in. */
+void conn_consume(struct conn *conn, size_t used);
+
+/* Appends to the output without writing; conn_flush() sends it. */
+int conn_queue(struct conn *conn, const void *msg, size_t len);
+
+/* Writes what the socket takes and queues the rest. */
+int conn_send(struct conn *conn, const void *msg, size_t len);
+
+int conn_flush(struct conn *conn);
+void conn_close(struct reactor *reactor, struct conn *conn);
+
+/* Frees a closed connection after the current epoll batch. */
+void conn_release(struct reactor *reactor, struct conn *conn);
+
+/* Closes the connection once it has no more input and every reply is out. */
+void conn_finish(struct reactor *reactor, struct conn *conn);
+
+/* Closes a reactor's open files, with -m file. */
+void files_destroy(struct file_cache *files);
+
+/* Opens the -J journal for -m resp and replays it into the store. Returns -1 on error. */
+int resp_journal_open(const char *dir);
+
+/* Parses -u ip:port[,ip:port...] for -m proxy. Returns -1 if it is not that. */
+int proxy_set_upstream(const char *spec);
+
+/* Sets -l rr|leastconn|hash. Returns -1 for anything else. */
+int proxy_set_policy(const char *name);
+
+/* Closes a reactor's warm backend connections. */
+void upstreams_destroy(struct upstream_pool *pool);
+
+void reactor_submit(struct reactor *from, unsigned core, struct message *msg);
+
+#endif /* SERVER_H */
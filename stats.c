@@ -0,0 +1,81 @@
+/**
+ * @file stats.c
+ *
+ * @brief Per-thread statistics that stay off each other's cache lines.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+static struct stats_block unset_block;
+
+_Thread_local struct stats_block *thread_stats = &unset_block;
+
+static const char *const counter_names[STAT_COUNTERS] = {
+    [STAT_ACCEPTED] = "accepted",
+    [STAT_CLOSED] = "closed",
+    [STAT_BYTES_IN] = "bytes in",
+    [STAT_BYTES_OUT] = "bytes out",
+    [STAT_MIGRATED_IN] = "migrated in",
+    [STAT_MIGRATED_OUT] = "migrated out",
+};
+
+
+struct stats_block *stats_alloc(const unsigned count, const bool shared) {
+    /* mmap gives page-aligned, zeroed memory either way. */
+    struct stats_block *blocks = mmap(NULL, count * sizeof(*blocks), PROT_READ | PROT_WRITE,
+                                      (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+    return blocks == MAP_FAILED ? NULL : blocks;
+}
+
+
+void stats_free(struct stats_block *blocks, const unsigned count) {
+    if (blocks) munmap(blocks, count * sizeof(*blocks));
+}
+
+
+void stats_sum(const struct stats_block *blocks, const unsigned count, struct stats_total *total) {
+    for (unsigned i = 0; i < STAT_COUNTERS; ++i) total->counters[i] = 0;
+    for (unsigned i = 0; i < STAT_BUCKETS; ++i) total->buckets[i] = 0;
+
+    for (unsigned b = 0; b < count; ++b) {
+        for (unsigned i = 0; i < STAT_COUNTERS; ++i) {
+            total->counters[i] += atomic_load_explicit(&blocks[b].counters[i], memory_order_relaxed);
+        }
+        for (unsigned i = 0; i < STAT_BUCKETS; ++i) {
+            total->buckets[i] += atomic_load_explicit(&blocks[b].buckets[i], memory_order_relaxed);
+        }
+    }
+}
+
+
+uint64_t stats_percentile(const struct stats_total *total, const double fraction) {
+    uint64_t samples = 0;
+    for (unsigned i = 0; i < STAT_BUCKETS; ++i) samples += total->buckets[i];
+    if (samples == 0) return 0;
+
+    const uint64_t rank = (uint64_t) (fraction * (double) samples);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < STAT_BUCKETS; ++i) {
+        seen += total->buckets[i];
+        if (seen > rank) return i ? UINT64_C(1) << i : 0;
+    }
+    return UINT64_C(1) << (STAT_BUCKETS - 1);
+}
+
+
+void stats_print(FILE *stream, const char *label, const struct stats_total *total) {
+    fprintf(stream, "[*] %s:", label);
+    for (unsigned i = 0; i < STAT_COUNTERS; ++i) {
+        fprintf(stream, "%s %" PRIu64 " %s", i ? "," : "", total->counters[i], counter_names[i]);
+    }
+    fprintf(stream, "; loop p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns.\n",
+            stats_percentile(total, 0.5), stats_percentile(total, 0.99), stats_percentile(total, 0.999));
+}
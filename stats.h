@@ -0,0 +1,82 @@
+/**
+ * @file stats.h
+ *
+ * @brief Per-thread statistics that stay off each other's cache lines.
+ *
+ * Every thread writes only its own block, with plain loads and stores, so
+ * counting costs no locked instruction and no cache-line transfer. Readers
+ * add the blocks up whenever they want a figure.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "queue.h"
+
+/* Power-of-two buckets: bucket i counts values in [2^(i-1), 2^i). */
+#define STAT_BUCKETS 48
+
+enum stat_counter {
+    STAT_ACCEPTED,
+    STAT_CLOSED,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_MIGRATED_IN,
+    STAT_MIGRATED_OUT,
+    STAT_COUNTERS
+};
+
+/* Written by one thread only; aligned so neighbours never share a line. */
+struct stats_block {
+    alignas(CACHE_LINE) atomic_uint_fast64_t counters[STAT_COUNTERS];
+    atomic_uint_fast64_t buckets[STAT_BUCKETS];
+};
+
+/* A reader's snapshot of one or more blocks added together. */
+struct stats_total {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t buckets[STAT_BUCKETS];
+};
+
+/* The block of the calling thread; set it before counting. */
+extern _Thread_local struct stats_block *thread_stats;
+
+/* Allocates `count` zeroed blocks. Shared blocks survive fork(), so a parent
+ * can read what its children count. Returns NULL on failure.
+ */
+struct stats_block *stats_alloc(unsigned count, bool shared);
+
+void stats_free(struct stats_block *blocks, unsigned count);
+
+/* Adds blocks[0..count) into total; safe while the owners keep writing. */
+void stats_sum(const struct stats_block *blocks, unsigned count, struct stats_total *total);
+
+/* Smallest bucket bound below which `fraction` of the recorded values fall. */
+uint64_t stats_percentile(const struct stats_total *total, double fraction);
+
+void stats_print(FILE *stream, const char *label, const struct stats_total *total);
+
+
+/* Only the owner writes, so a relaxed load + store is enough: no lock prefix. */
+static inline void stat_add(const enum stat_counter counter, const uint64_t n) {
+    atomic_uint_fast64_t *slot = &thread_stats->counters[counter];
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+static inline void stat_record(const uint64_t value) {
+    const unsigned bucket = value ? 64 - (unsigned) __builtin_clzll(value) : 0;
+    atomic_uint_fast64_t *slot = &thread_stats->buckets[bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1];
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+#endif /* STATS_H */
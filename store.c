@@ -0,0 +1,144 @@
+/**
+ * @file store.c
+ *
+ * @brief In-process key-value store behind the server's GET/SET commands.
+ *
+ * A chained hash table behind one mutex, shared by every reactor thread of
+ * the process.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+
+#define STORE_INITIAL_BUCKETS 1024
+
+
+struct entry {
+    struct entry *next;
+    uint64_t hash;
+    size_t key_len;
+    size_t value_len;
+    char data[];                /* key, then value */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct entry **buckets;
+static size_t bucket_count;
+static size_t entry_count;
+
+
+/* FNV-1a. */
+static uint64_t hash_key(const char *key, const size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+static struct entry **find(const char *key, const size_t key_len, const uint64_t hash) {
+    struct entry **slot = &buckets[hash & (bucket_count - 1)];
+    while (*slot) {
+        const struct entry *e = *slot;
+        if (e->hash == hash && e->key_len == key_len && memcmp(e->data, key, key_len) == 0) break;
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+
+/* Doubles the table once it averages one entry per bucket. */
+static void grow(void) {
+    const size_t count = bucket_count ? bucket_count * 2 : STORE_INITIAL_BUCKETS;
+    struct entry **table = calloc(count, sizeof(*table));
+    if (table == NULL) return;
+
+    for (size_t i = 0; i < bucket_count; ++i) {
+        while (buckets[i]) {
+            struct entry *e = buckets[i];
+            buckets[i] = e->next;
+            e->next = table[e->hash & (count - 1)];
+            table[e->hash & (count - 1)] = e;
+        }
+    }
+    free(buckets);
+    buckets = table;
+    bucket_count = count;
+}
+
+
+int store_set(const char *key, const size_t key_len, const char *value, const size_t value_len) {
+    const uint64_t hash = hash_key(key, key_len);
+    struct entry *e = malloc(sizeof(*e) + key_len + value_len);
+    if (e == NULL) return -1;
+    e->hash = hash;
+    e->key_len = key_len;
+    e->value_len = value_len;
+    memcpy(e->data, key, key_len);
+    memcpy(e->data + key_len, value, value_len);
+
+    pthread_mutex_lock(&lock);
+    if (entry_count >= bucket_count) grow();
+    if (buckets == NULL) {
+        pthread_mutex_unlock(&lock);
+        free(e);
+        return -1;
+    }
+    struct entry **slot = find(key, key_len, hash);
+    struct entry *old = *slot;
+    e->next = old ? old->next : NULL;
+    *slot = e;
+    if (old == NULL) entry_count++;
+    pthread_mutex_unlock(&lock);
+
+    free(old);
+    return 0;
+}
+
+
+bool store_get(const char *key, const size_t key_len, const store_emit emit, void *ctx) {
+    const uint64_t hash = hash_key(key, key_len);
+    bool found = false;
+
+    pthread_mutex_lock(&lock);
+    if (buckets) {
+        const struct entry *e = *find(key, key_len, hash);
+        if (e) {
+            emit(ctx, e->data + e->key_len, e->value_len);
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+
+bool store_delete(const char *key, const size_t key_len) {
+    const uint64_t hash = hash_key(key, key_len);
+    struct entry *e = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (buckets) {
+        struct entry **slot = find(key, key_len, hash);
+        e = *slot;
+        if (e) {
+            *slot = e->next;
+            entry_count--;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(e);
+    return e != NULL;
+}
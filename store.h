@@ -0,0 +1,29 @@
+/**
+ * @file store.h
+ *
+ * @brief In-process key-value store behind the server's GET/SET commands.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Receives a value while the store still holds it; copy what you keep. */
+typedef void (*store_emit)(void *ctx, const char *value, size_t len);
+
+/* Returns -1 when out of memory. */
+int store_set(const char *key, size_t key_len, const char *value, size_t value_len);
+
+/* Calls emit with the value and returns true, or returns false when the key is missing. */
+bool store_get(const char *key, size_t key_len, store_emit emit, void *ctx);
+
+bool store_delete(const char *key, size_t key_len);
+
+#endif /* STORE_H */
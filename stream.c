@@ -0,0 +1,218 @@
+/**
+ * @file stream.c
+ *
+ * @brief One-way throughput modes: discard (RFC 863) and chargen (RFC 864).
+ *
+ * Discard moves what arrives from the socket into a pipe and from the pipe
+ * into /dev/null with splice(), so the data never reaches user space; where
+ * splice is refused it falls back to large reads. Chargen keeps its pattern
+ * in a memfd built on the first connection and streams it with
+ * sendfile(), so sending costs no per-byte work in the server.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "server.h"
+
+#define SINK_PIPE_SIZE (1024 * 1024)
+#define SINK_BUFFER_SIZE (256 * 1024)
+#define CHARGEN_LINE 72
+#define CHARGEN_CHARS 95            /* printable ASCII, ' ' to '~' */
+#define CHARGEN_PERIODS 149         /* about 1 MiB of whole periods, so the stream wraps seamlessly */
+
+
+/* Where discarded bytes go: one per thread, for as long as the thread runs. */
+struct sink {
+    bool ready;
+    bool spliced;               /* false: splice is not possible, read instead */
+    int pipe[2];
+    int null_fd;
+    char *buffer;
+};
+
+static _Thread_local struct sink sink;
+
+static pthread_once_t pattern_once = PTHREAD_ONCE_INIT;
+static int pattern_fd = -1;
+static off_t pattern_size;
+
+
+static void sink_init(void) {
+    sink.ready = true;
+    sink.null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (sink.null_fd != -1 && pipe2(sink.pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        fcntl(sink.pipe[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+        sink.spliced = true;
+        return;
+    }
+    if (sink.null_fd != -1) close(sink.null_fd);
+}
+
+
+/* Moves n bytes from the pipe to /dev/null. */
+static int sink_drain(size_t n) {
+    while (n) {
+        const ssize_t moved = splice(sink.pipe[0], NULL, sink.null_fd, NULL, n, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            if (moved == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        n -= (size_t) moved;
+    }
+    return 0;
+}
+
+
+/* Reads up to the largest chunk one call takes and drops it. Returns the
+ * bytes consumed, 0 at EOF, or -1 with errno set.
+ */
+static ssize_t sink_take(const int fd) {
+    if (!sink.ready) sink_init();
+
+    if (sink.spliced) {
+        const ssize_t n = splice(fd, NULL, sink.pipe[1], NULL, SINK_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0 && sink_drain((size_t) n) == -1) return -1;
+        if (n != -1 || errno != EINVAL) return n;
+        /* This socket type cannot splice: read from now on. */
+        sink.spliced = false;
+    }
+    if (sink.buffer == NULL) {
+        sink.buffer = malloc(SINK_BUFFER_SIZE);
+        if (sink.buffer == NULL) return -1;
+    }
+    return read(fd, sink.buffer, SINK_BUFFER_SIZE);
+}
+
+
+/* Drops everything the peer sends, until EAGAIN. */
+static void discard_readable(struct reactor *reactor, struct conn *conn) {
+    while (!conn->eof) {
+        const ssize_t n = sink_take(conn->watch.fd);
+        if (n > 0) {
+            conn->bytes += (uint64_t) n;
+            stat_add(STAT_BYTES_IN, (uint64_t) n);
+            continue;
+        }
+        if (n == 0) {
+            conn->eof = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("discard");
+            conn_close(reactor, conn);
+        }
+        return;
+    }
+    conn_finish(reactor, conn);
+}
+
+
+const struct protocol discard_protocol = {
+    .name = "discard",
+    .on_readable = discard_readable,
+};
+
+
+/* 72-character lines, each starting one character further along the
+ * printable set; the pattern repeats every 95 lines.
+ */
+static void pattern_init(void) {
+    const size_t period = CHARGEN_CHARS * (CHARGEN_LINE + 2);
+    const size_t size = period * CHARGEN_PERIODS;
+
+    const int fd = memfd_create("chargen", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, (off_t) size) == -1) {
+        perror("memfd_create");
+        exit(14);
+    }
+    char *pattern = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pattern == MAP_FAILED) {
+        perror("mmap");
+        exit(14);
+    }
+    for (size_t line = 0; line < CHARGEN_CHARS; ++line) {
+        char *p = pattern + line * (CHARGEN_LINE + 2);
+        for (size_t i = 0; i < CHARGEN_LINE; ++i) p[i] = (char) (' ' + (line + i) % CHARGEN_CHARS);
+        p[CHARGEN_LINE] = '\r';
+        p[CHARGEN_LINE + 1] = '\n';
+    }
+    for (size_t copy = 1; copy < CHARGEN_PERIODS; ++copy) memcpy(pattern + copy * period, pattern, period);
+    munmap(pattern, size);
+
+    pattern_fd = fd;
+    pattern_size = (off_t) size;
+}
+
+
+/* Per connection: where in the pattern the stream is. */
+struct chargen {
+    off_t offset;
+};
+
+
+/* Sends until the socket is full. The file offset stays untouched, so every
+ * connection can share the one memfd.
+ */
+static void chargen_pump(struct reactor *reactor, struct conn *conn) {
+    struct chargen *state = conn->session;
+
+    while (true) {
+        const ssize_t sent = sendfile(conn->watch.fd, pattern_fd, &state->offset,
+                                      (size_t) (pattern_size - state->offset));
+        if (sent > 0) {
+            stat_add(STAT_BYTES_OUT, (uint64_t) sent);
+            if (state->offset == pattern_size) state->offset = 0;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("sendfile");
+            conn_close(reactor, conn);
+        }
+        return;
+    }
+}
+
+
+/* The first EPOLLOUT starts the stream. */
+static int chargen_open(struct reactor *reactor, struct conn *conn) {
+    pthread_once(&pattern_once, pattern_init);
+    conn->session = calloc(1, sizeof(struct chargen));
+    return conn->session ? 0 : -1;
+}
+
+
+/* Input is ignored; the peer's EOF ends the stream. */
+static void chargen_readable(struct reactor *reactor, struct conn *conn) {
+    discard_readable(reactor, conn);
+}
+
+
+static void chargen_close(struct reactor *reactor, struct conn *conn) {
+    free(conn->session);
+    conn->session = NULL;
+}
+
+
+const struct protocol chargen_protocol = {
+    .name = "chargen",
+    .on_open = chargen_open,
+    .on_readable = chargen_readable,
+    .on_writable = chargen_pump,
+    .on_close = chargen_close,
+};
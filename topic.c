@@ -0,0 +1,308 @@
+/**
+ * @file topic.c
+ *
+ * @brief Topic routing trie with "*" and "#" wildcards.
+ *
+ * A node stands for one segment. Its literal children are not kept in the
+ * node but in one open-addressing edge table per tree, keyed by parent and
+ * segment: a slot is a hash and a pointer, so a lookup usually costs one
+ * cache line for the probe and one for the node it finds. The "*" and "#"
+ * children hang off the node directly, as every match has to look at them.
+ *
+ * Matching walks the topic one segment at a time, following the literal
+ * child, the "*" child and the "#" child of each node, so its cost depends
+ * on the depth of the topic and the wildcards on its path, not on the number
+ * of subscriptions. Subscribing and unsubscribing touch one path; nodes left
+ * without entries or children are freed on the way back up.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "topic.h"
+
+#define EDGE_TABLE_MIN 1024
+#define MAX_SEGMENTS (TOPIC_MAX_LEN + 1)  /* every byte a '.' */
+
+struct topic_node {
+    struct topic_node *parent;
+    struct topic_node *star;        /* the "*" child */
+    struct topic_node *rest;        /* the "#" child */
+    struct topic_entry *entries;    /* patterns that end here */
+    uint64_t hash;                  /* of the edge from the parent, for literal children */
+    unsigned children;              /* literal children, in the edge table */
+    unsigned len;
+    char segment[];
+};
+
+struct edge {
+    uint64_t hash;
+    struct topic_node *node;        /* NULL: empty slot */
+};
+
+struct topic_tree {
+    struct topic_node root;
+    struct edge *edges;
+    size_t capacity;                /* a power of two */
+    size_t count;
+};
+
+/* Where a topic's segments start and end. */
+struct segments {
+    unsigned count;
+    const char *start[MAX_SEGMENTS];
+    unsigned len[MAX_SEGMENTS];
+};
+
+
+static uint64_t edge_hash(const struct topic_node *parent, const char *segment, const size_t len) {
+    return cache_hash(segment, len) ^ ((uint64_t) (uintptr_t) parent * 0x9e3779b97f4a7c15ULL);
+}
+
+
+static struct topic_node *edge_find(const struct topic_tree *tree, const struct topic_node *parent,
+                                    const char *segment, const size_t len) {
+    const uint64_t hash = edge_hash(parent, segment, len);
+    const size_t mask = tree->capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const struct edge *edge = &tree->edges[i];
+        if (edge->node == NULL) return NULL;
+        if (edge->hash == hash && edge->node->parent == parent && edge->node->len == len
+            && memcmp(edge->node->segment, segment, len) == 0) {
+            return edge->node;
+        }
+    }
+}
+
+
+static void edge_place(struct edge *edges, const size_t capacity, const uint64_t hash, struct topic_node *node) {
+    size_t i = hash & (capacity - 1);
+    while (edges[i].node) i = (i + 1) & (capacity - 1);
+    edges[i] = (struct edge) { hash, node };
+}
+
+
+/* Keeps the table at most half full. */
+static int edge_reserve(struct topic_tree *tree) {
+    if ((tree->count + 1) * 2 <= tree->capacity) return 0;
+
+    const size_t capacity = tree->capacity * 2;
+    struct edge *edges = calloc(capacity, sizeof(*edges));
+    if (edges == NULL) return -1;
+    for (size_t i = 0; i < tree->capacity; ++i) {
+        if (tree->edges[i].node) edge_place(edges, capacity, tree->edges[i].hash, tree->edges[i].node);
+    }
+    free(tree->edges);
+    tree->edges = edges;
+    tree->capacity = capacity;
+    return 0;
+}
+
+
+/* Backward-shift deletion: later slots of the probe run move up, so no
+ * tombstones build up under churn.
+ */
+static void edge_remove(struct topic_tree *tree, const struct topic_node *node) {
+    const size_t mask = tree->capacity - 1;
+    size_t i = node->hash & mask;
+    while (tree->edges[i].node != node) i = (i + 1) & mask;
+
+    for (size_t j = (i + 1) & mask; tree->edges[j].node; j = (j + 1) & mask) {
+        const size_t home = tree->edges[j].hash & mask;
+        /* Move j into the hole unless its home lies cyclically in (i, j]. */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            tree->edges[i] = tree->edges[j];
+            i = j;
+        }
+    }
+    tree->edges[i].node = NULL;
+    tree->count--;
+}
+
+
+struct topic_tree *topic_tree_create(void) {
+    struct topic_tree *tree = calloc(1, sizeof(*tree));
+    if (tree == NULL) return NULL;
+    tree->capacity = EDGE_TABLE_MIN;
+    tree->edges = calloc(tree->capacity, sizeof(*tree->edges));
+    if (tree->edges == NULL) {
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+
+static void node_free(struct topic_node *node) {
+    if (node->star) node_free(node->star);
+    if (node->rest) node_free(node->rest);
+    free(node);
+}
+
+
+void topic_tree_destroy(struct topic_tree *tree) {
+    if (tree == NULL) return;
+    for (size_t i = 0; i < tree->capacity; ++i) {
+        struct topic_node *node = tree->edges[i].node;
+        if (node == NULL) continue;
+        if (node->star) node_free(node->star);
+        if (node->rest) node_free(node->rest);
+        free(node);
+    }
+    if (tree->root.star) node_free(tree->root.star);
+    if (tree->root.rest) node_free(tree->root.rest);
+    free(tree->edges);
+    free(tree);
+}
+
+
+/* Splits at '.'. Returns -1 if the topic is too long. */
+static int split(const char *topic, const size_t len, struct segments *segments) {
+    if (len == 0 || len > TOPIC_MAX_LEN) return -1;
+    segments->count = 0;
+    for (size_t start = 0;;) {
+        const char *dot = memchr(topic + start, '.', len - start);
+        const size_t end = dot ? (size_t) (dot - topic) : len;
+        segments->start[segments->count] = topic + start;
+        segments->len[segments->count] = (unsigned) (end - start);
+        segments->count++;
+        if (dot == NULL) return 0;
+        start = end + 1;
+    }
+}
+
+
+static bool is_wildcard(const char *segment, const unsigned len, const char which) {
+    return len == 1 && segment[0] == which;
+}
+
+
+bool topic_valid(const char *topic, const size_t len) {
+    return len && len <= TOPIC_MAX_LEN && !memchr(topic, '*', len) && !memchr(topic, '#', len)
+           && !memchr(topic, ' ', len);
+}
+
+
+static struct topic_node *node_create(struct topic_node *parent, const char *segment, const unsigned len) {
+    struct topic_node *node = calloc(1, sizeof(*node) + len);
+    if (node == NULL) return NULL;
+    node->parent = parent;
+    node->len = len;
+    memcpy(node->segment, segment, len);
+    return node;
+}
+
+
+/* Frees nodes left with nothing under them, from node up. */
+static void prune(struct topic_tree *tree, struct topic_node *node) {
+    while (node != &tree->root && node->entries == NULL && node->children == 0 && !node->star && !node->rest) {
+        struct topic_node *parent = node->parent;
+        if (parent->star == node) parent->star = NULL;
+        else if (parent->rest == node) parent->rest = NULL;
+        else {
+            edge_remove(tree, node);
+            parent->children--;
+        }
+        free(node);
+        node = parent;
+    }
+}
+
+
+int topic_subscribe(struct topic_tree *tree, struct topic_entry *entry, const char *pattern, const size_t len) {
+    struct segments segments;
+
+    if (memchr(pattern, ' ', len) || split(pattern, len, &segments)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (unsigned i = 0; i < segments.count; ++i) {
+        const char *segment = segments.start[i];
+        const unsigned seg_len = segments.len[i];
+        const bool wildcard = is_wildcard(segment, seg_len, '*') || is_wildcard(segment, seg_len, '#');
+        if ((!wildcard && (memchr(segment, '*', seg_len) || memchr(segment, '#', seg_len)))
+            || (is_wildcard(segment, seg_len, '#') && i + 1 != segments.count)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    struct topic_node *node = &tree->root;
+    for (unsigned i = 0; i < segments.count; ++i) {
+        const char *segment = segments.start[i];
+        const unsigned seg_len = segments.len[i];
+        struct topic_node **slot = is_wildcard(segment, seg_len, '*') ? &node->star
+                                 : is_wildcard(segment, seg_len, '#') ? &node->rest : NULL;
+        struct topic_node *child = slot ? *slot : edge_find(tree, node, segment, seg_len);
+        if (child == NULL) {
+            if ((slot == NULL && edge_reserve(tree)) || (child = node_create(node, segment, seg_len)) == NULL) {
+                prune(tree, node);
+                errno = ENOMEM;
+                return -1;
+            }
+            if (slot) *slot = child;
+            else {
+                child->hash = edge_hash(node, segment, seg_len);
+                edge_place(tree->edges, tree->capacity, child->hash, child);
+                tree->count++;
+                node->children++;
+            }
+        }
+        node = child;
+    }
+
+    entry->node = node;
+    entry->prev = NULL;
+    entry->next = node->entries;
+    if (node->entries) node->entries->prev = entry;
+    node->entries = entry;
+    return 0;
+}
+
+
+void topic_unsubscribe(struct topic_tree *tree, struct topic_entry *entry) {
+    struct topic_node *node = entry->node;
+
+    if (entry->prev) entry->prev->next = entry->next;
+    else node->entries = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    entry->node = NULL;
+    prune(tree, node);
+}
+
+
+static void match_node(const struct topic_tree *tree, const struct topic_node *node, const struct segments *segments,
+                       const unsigned depth, void (*fn)(struct topic_entry *entry, void *arg), void *arg) {
+    /* "#" takes the rest, however many segments that is. */
+    const bool wild = depth > 0 || segments->len[0] == 0 || segments->start[0][0] != '$';
+    if (wild && node->rest) {
+        for (struct topic_entry *entry = node->rest->entries; entry; entry = entry->next) fn(entry, arg);
+    }
+    if (depth == segments->count) {
+        for (struct topic_entry *entry = node->entries; entry; entry = entry->next) fn(entry, arg);
+        return;
+    }
+
+    const struct topic_node *child = node->children
+                                   ? edge_find(tree, node, segments->start[depth], segments->len[depth]) : NULL;
+    if (child) match_node(tree, child, segments, depth + 1, fn, arg);
+    if (wild && node->star) match_node(tree, node->star, segments, depth + 1, fn, arg);
+}
+
+
+void topic_match(const struct topic_tree *tree, const char *topic, const size_t len,
+                 void (*fn)(struct topic_entry *entry, void *arg), void *arg) {
+    struct segments segments;
+
+    if (split(topic, len, &segments)) return;
+    match_node(tree, &tree->root, &segments, 0, fn, arg);
+}
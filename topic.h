@@ -0,0 +1,60 @@
+/**
+ * @file topic.h
+ *
+ * @brief Topic routing for pub/sub: a trie over dot-separated segments.
+ *
+ * Patterns may use "*" for exactly one segment and "#", as the last
+ * segment, for any number of them including none. Wildcards do not match
+ * a first segment that starts with '$'. A tree is not thread-safe; each
+ * reactor owns one.
+ *
+ * @author WhiteMonsterZeroUltraEnergy
+ * @license MIT
+ *
+ * https://github.com/WhiteMonsterZeroUltraEnergy
+ */
+
+#ifndef TOPIC_H
+#define TOPIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TOPIC_MAX_LEN 255
+
+struct topic_node;
+
+/* One subscription. Embed it in the subscriber's own record and recover
+ * that with container_of() in the match callback.
+ */
+struct topic_entry {
+    struct topic_node *node;
+    struct topic_entry *prev;
+    struct topic_entry *next;
+};
+
+struct topic_tree;
+
+/* Returns NULL when out of memory. */
+struct topic_tree *topic_tree_create(void);
+
+/* Frees the index only; the entries belong to their subscribers. */
+void topic_tree_destroy(struct topic_tree *tree);
+
+/* A topic to publish to: no wildcards. */
+bool topic_valid(const char *topic, size_t len);
+
+/* Adds the entry under pattern. Returns -1 with errno EINVAL for a bad
+ * pattern, or ENOMEM.
+ */
+int topic_subscribe(struct topic_tree *tree, struct topic_entry *entry, const char *pattern, size_t len);
+
+void topic_unsubscribe(struct topic_tree *tree, struct topic_entry *entry);
+
+/* Calls fn for every entry whose pattern matches the topic. The tree must
+ * not change until it returns.
+ */
+void topic_match(const struct topic_tree *tree, const char *topic, size_t len,
+                 void (*fn)(struct topic_entry *entry, void *arg), void *arg);
+
+#endif /* TOPIC_H */